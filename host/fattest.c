@@ -0,0 +1,674 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sd.h"
+#include "fat.h"
+#include "bcache.h"
+#include "host.h"
+
+/*
+ * Host test and benchmark for the FAT layer. Generates FAT16 and FAT32
+ * images of different sizes and fragmentation, mounts them through the
+ * file-backed SD shim, checks what the kernel API returns against what was
+ * written, and reports lookup and read throughput with the number of card
+ * commands that went out. Run with make hosttest.
+ */
+
+#define PART_LBA 2048
+#define BIG_SIZE (8 << 20)
+#define FILLER_SIZE (4 << 20)
+#define MANY 2000
+#define CHUNK 65536
+
+typedef struct
+{
+    char *name;
+    int fat32;
+    unsigned int mb;
+    unsigned int spc;
+    unsigned int frag; // clusters per piece when interleaving files, 0 contiguous
+} config_t;
+
+static config_t configs[] = {
+    {"fat16-32M-contig", 0, 32, 4, 0},
+    {"fat16-64M-frag", 0, 64, 8, 1},
+    {"fat32-64M-contig", 1, 64, 1, 0},
+    {"fat32-256M-frag", 1, 256, 4, 3},
+};
+
+// the image being generated, and its geometry in absolute sectors
+static unsigned char *img;
+static unsigned long img_size;
+static unsigned int img_fat32, img_spc, img_fat, img_spf, img_root, img_rootents, img_data, img_maxclust, img_next;
+static unsigned int big_clust, filler_clust;
+
+static int fails;
+
+#define CHECK(c, what)                                                   \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("  FAIL %s (%s:%d)\n", what, __FILE__, __LINE__);     \
+            fails++;                                                     \
+        }                                                                \
+    } while (0)
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * Expected content of file id at offset
+ */
+static unsigned char pat(unsigned int id, unsigned int off)
+{
+    return ((off * 2654435761u) >> 24) ^ (id * 37);
+}
+
+static void put16(unsigned char *p, unsigned int v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, unsigned int v)
+{
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+static unsigned char *sec(unsigned int lba)
+{
+    return img + (unsigned long)lba * 512;
+}
+
+static unsigned char *clust(unsigned int c)
+{
+    return sec(img_data + (c - 2) * img_spc);
+}
+
+/**
+ * Set a FAT entry in both FATs, -1 is end of chain
+ */
+static void fat_put(unsigned int c, unsigned int v)
+{
+    int i;
+    for (i = 0; i < 2; i++)
+    {
+        if (img_fat32)
+            put32(sec(img_fat + i * img_spf) + c * 4, v & 0x0FFFFFFF);
+        else
+            put16(sec(img_fat + i * img_spf) + c * 2, v);
+    }
+}
+
+static unsigned int alloc_cluster()
+{
+    if (img_next > img_maxclust)
+    {
+        printf("image full\n");
+        exit(1);
+    }
+    memset(clust(img_next), 0, img_spc * 512);
+    fat_put(img_next, -1);
+    return img_next++;
+}
+
+/**
+ * Write files with their clusters interleaved frag at a time, returns first clusters
+ */
+static void mk_files(unsigned int *ids, unsigned int *sizes, unsigned int *first, int n, unsigned int frag)
+{
+    unsigned int csize = img_spc * 512, done[8] = {0}, last[8] = {0}, c, k, j, len, left;
+    int i;
+    for (left = 1; left;)
+        for (left = 0, i = 0; i < n; i++)
+        {
+            for (k = 0; done[i] < sizes[i] && (!frag || k < frag); k++)
+            {
+                c = alloc_cluster();
+                if (last[i])
+                    fat_put(last[i], c);
+                else
+                    first[i] = c;
+                last[i] = c;
+                len = sizes[i] - done[i] < csize ? sizes[i] - done[i] : csize;
+                for (j = 0; j < len; j++)
+                    clust(c)[j] = pat(ids[i], done[i] + j);
+                done[i] += len;
+            }
+            left += done[i] < sizes[i];
+        }
+}
+
+typedef struct
+{
+    unsigned int clust; // 0 for the FAT16 root
+    unsigned int last;
+    unsigned int n;
+} mkdir_t;
+
+/**
+ * Next free entry of a directory being generated, growing it if needed
+ */
+static unsigned char *dir_slot(mkdir_t *d)
+{
+    unsigned int per = img_spc * 16, c;
+    if (!d->clust)
+    {
+        if (d->n >= img_rootents)
+        {
+            printf("root directory full\n");
+            exit(1);
+        }
+        return sec(img_root) + d->n++ * 32;
+    }
+    if (d->n && d->n % per == 0)
+    {
+        c = alloc_cluster();
+        fat_put(d->last, c);
+        d->last = c;
+    }
+    return clust(d->last) + (d->n++ % per) * 32;
+}
+
+/**
+ * Add an entry, with VFAT long name parts in front if lfn is given
+ */
+static void add_entry(mkdir_t *d, char *lfn, char *sfn, unsigned char attr, unsigned int c, unsigned int size)
+{
+    static const unsigned char offs[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+    unsigned int len, parts, k, j, i;
+    unsigned char sum = 0, *e;
+    for (j = 0; j < 11; j++)
+        sum = ((sum & 1) << 7) + (sum >> 1) + (unsigned char)sfn[j];
+    if (lfn)
+    {
+        len = strlen(lfn);
+        parts = (len + 12) / 13;
+        for (k = parts; k > 0; k--)
+        {
+            e = dir_slot(d);
+            memset(e, 0, 32);
+            e[0] = k | (k == parts ? 0x40 : 0);
+            e[11] = 0xF;
+            e[13] = sum;
+            for (j = 0; j < 13; j++)
+            {
+                i = (k - 1) * 13 + j;
+                put16(e + offs[j], i < len ? (unsigned char)lfn[i] : i == len ? 0 : 0xFFFF);
+            }
+        }
+    }
+    e = dir_slot(d);
+    memset(e, 0, 32);
+    memcpy(e, sfn, 11);
+    e[11] = attr;
+    put16(e + 20, c >> 16);
+    put16(e + 26, c);
+    put32(e + 28, size);
+}
+
+/**
+ * Start a subdirectory with its . and .. entries
+ */
+static void mk_subdir(mkdir_t *parent, mkdir_t *d, char *lfn, char *sfn)
+{
+    d->clust = d->last = alloc_cluster();
+    d->n = 0;
+    add_entry(d, 0, ".          ", 0x10, d->clust, 0);
+    add_entry(d, 0, "..         ", 0x10, parent->clust, 0);
+    add_entry(parent, lfn, sfn, 0x10, d->clust, 0);
+}
+
+static unsigned int many_size(unsigned int i)
+{
+    return 100 + i % 400;
+}
+
+/**
+ * Generate an image with a partition table, boot record, FATs and the test
+ * files: /big.bin, /Filler Data.bin, /docs/Read Me First.txt and /many/ with
+ * MANY long named files
+ */
+static void mkimage(config_t *cfg, char *path)
+{
+    unsigned int ts, rsc, clusters, i, ids[2], sizes[2], first[2], c;
+    unsigned char *mbr, *bpb, *info;
+    mkdir_t root, many, docs;
+    char lfn[64], sfn[12];
+    FILE *f;
+
+    img_size = (unsigned long)cfg->mb << 20;
+    img = calloc(1, img_size);
+    img_fat32 = cfg->fat32;
+    img_spc = cfg->spc;
+    ts = img_size / 512 - PART_LBA;
+    rsc = img_fat32 ? 32 : 4;
+    img_rootents = img_fat32 ? 0 : 512;
+    // sectors per FAT, good enough after one refinement
+    clusters = (ts - rsc - img_rootents / 16) / img_spc;
+    img_spf = ((clusters + 2) * (img_fat32 ? 4 : 2) + 511) / 512;
+    clusters = (ts - rsc - img_rootents / 16 - 2 * img_spf) / img_spc;
+    if (img_fat32 ? clusters < 65525 : clusters < 4085 || clusters > 65524)
+    {
+        printf("bad geometry for %s: %u clusters\n", cfg->name, clusters);
+        exit(1);
+    }
+    img_fat = PART_LBA + rsc;
+    img_root = img_fat + 2 * img_spf;
+    img_data = img_root + img_rootents / 16;
+    img_maxclust = clusters + 1;
+    img_next = 2;
+
+    mbr = sec(0);
+    put32(mbr + 0x1B8, 0xBA6E1050);
+    mbr[0x1C2] = img_fat32 ? 0xC : 0xE;
+    put32(mbr + 0x1C6, PART_LBA);
+    put32(mbr + 0x1CA, ts);
+    mbr[510] = 0x55;
+    mbr[511] = 0xAA;
+
+    bpb = sec(PART_LBA);
+    memcpy(bpb, "\xEB\x3C\x90" "BAGELOS ", 11);
+    put16(bpb + 11, 512);
+    bpb[13] = img_spc;
+    put16(bpb + 14, rsc);
+    bpb[16] = 2;
+    put16(bpb + 17, img_rootents);
+    if (ts < 65536 && !img_fat32)
+        put16(bpb + 19, ts);
+    else
+        put32(bpb + 32, ts);
+    bpb[21] = 0xF8;
+    put16(bpb + 24, 32);
+    put16(bpb + 26, 64);
+    put32(bpb + 28, PART_LBA);
+    if (img_fat32)
+    {
+        put32(bpb + 36, img_spf);
+        put32(bpb + 44, 2);
+        put16(bpb + 48, 1);
+        put16(bpb + 50, 6);
+        bpb[66] = 0x29;
+        memcpy(bpb + 71, "BAGELTEST  FAT32   ", 19);
+    }
+    else
+    {
+        put16(bpb + 22, img_spf);
+        bpb[38] = 0x29;
+        memcpy(bpb + 43, "BAGELTEST  FAT16   ", 19);
+    }
+    bpb[510] = 0x55;
+    bpb[511] = 0xAA;
+
+    fat_put(0, 0xFFFFFFF8);
+    fat_put(1, -1);
+    root.clust = root.last = img_fat32 ? alloc_cluster() : 0;
+    root.n = 0;
+
+    // the two big files, interleaved to get the requested fragmentation
+    ids[0] = 1;
+    ids[1] = 2;
+    sizes[0] = BIG_SIZE;
+    sizes[1] = FILLER_SIZE;
+    mk_files(ids, sizes, first, 2, cfg->frag);
+    big_clust = first[0];
+    filler_clust = first[1];
+    add_entry(&root, 0, "BIG     BIN", 0x20, big_clust, BIG_SIZE);
+    add_entry(&root, "Filler Data.bin", "FILLER~1BIN", 0x20, filler_clust, FILLER_SIZE);
+
+    mk_subdir(&root, &docs, 0, "DOCS       ");
+    ids[0] = 3;
+    sizes[0] = 5000;
+    mk_files(ids, sizes, first, 1, 0);
+    add_entry(&docs, "Read Me First.txt", "README~1TXT", 0x20, first[0], 5000);
+
+    mk_subdir(&root, &many, 0, "MANY       ");
+    for (i = 0; i < MANY; i++)
+    {
+        ids[0] = 100 + i;
+        sizes[0] = many_size(i);
+        mk_files(ids, sizes, first, 1, 0);
+        sprintf(lfn, "long file name number %05u.dat", i);
+        sprintf(sfn, "L%07uDAT", i);
+        add_entry(&many, lfn, sfn, 0x20, first[0], sizes[0]);
+    }
+
+    if (img_fat32)
+    {
+        info = sec(PART_LBA + 1);
+        put32(info, 0x41615252);
+        put32(info + 484, 0x61417272);
+        put32(info + 488, img_maxclust + 1 - img_next);
+        put32(info + 492, img_next);
+        put32(info + 508, 0xAA550000);
+    }
+    // used clusters can't leak into the "free" space, check the generator
+    for (c = img_next; c <= img_maxclust; c += 997)
+        CHECK(!(img_fat32 ? *(unsigned int *)(sec(img_fat) + c * 4) : *(unsigned short *)(sec(img_fat) + c * 2)),
+              "generator left free space free");
+
+    f = fopen(path, "wb");
+    if (!f || fwrite(img, 1, img_size, f) != img_size)
+    {
+        perror(path);
+        exit(1);
+    }
+    fclose(f);
+    free(img);
+}
+
+/**
+ * Re-read the image file and count free clusters in the first FAT. Also
+ * checks that the second FAT is an exact copy
+ */
+static unsigned int img_freecount(char *path, int *mirrored)
+{
+    unsigned char *fat = malloc(img_spf * 1024);
+    unsigned int c, n = 0;
+    FILE *f = fopen(path, "rb");
+    fseek(f, (long)img_fat * 512, SEEK_SET);
+    if (fread(fat, 512, img_spf * 2, f) != img_spf * 2)
+        n = -1;
+    fclose(f);
+    *mirrored = !memcmp(fat, fat + img_spf * 512, img_spf * 512);
+    for (c = 2; c <= img_maxclust; c++)
+        if (!(img_fat32 ? *(unsigned int *)(fat + c * 4) & 0x0FFFFFFF : *(unsigned short *)(fat + c * 2)))
+            n++;
+    free(fat);
+    return n;
+}
+
+static unsigned int img_fsinfo(char *path)
+{
+    unsigned char info[512];
+    FILE *f = fopen(path, "rb");
+    fseek(f, (long)(PART_LBA + 1) * 512, SEEK_SET);
+    if (fread(info, 512, 1, f) != 1)
+        return -1;
+    fclose(f);
+    return *(unsigned int *)(info + 488);
+}
+
+static int verify(unsigned int id, unsigned int off, unsigned char *buf, unsigned int len)
+{
+    unsigned int i;
+    for (i = 0; i < len; i++)
+        if (buf[i] != pat(id, off + i))
+            return 0;
+    return 1;
+}
+
+typedef struct
+{
+    unsigned int id, off, pieces;
+    int ok;
+} extent_arg_t;
+
+static int extent_cb(unsigned char *buffer, unsigned int len, void *arg)
+{
+    extent_arg_t *a = arg;
+    a->ok &= verify(a->id, a->off, buffer, len);
+    a->off += len;
+    a->pieces++;
+    return 1;
+}
+
+static unsigned char buf[CHUNK], wbuf[CHUNK];
+
+static void test_read(char *path)
+{
+    unsigned int n, total = 0, i, off, len, hits, misses, ra;
+    unsigned long cmds, blocks;
+    extent_arg_t arg;
+    fat_file_t file;
+    unsigned char *data;
+    double t;
+    int fd, ok = 1;
+
+    // sequential streaming through a fixed buffer
+    bcache_invalidate();
+    cmds = host_reads;
+    blocks = host_readblocks;
+    t = now();
+    fd = fat_open("/big.bin");
+    CHECK(fd >= 0, "open /big.bin");
+    while ((n = fat_read(fd, buf, CHUNK)))
+    {
+        ok &= verify(1, total, buf, n);
+        total += n;
+    }
+    t = now() - t;
+    fat_close(fd);
+    CHECK(ok && total == BIG_SIZE, "stream /big.bin");
+    // straight into the caller's buffer, only FAT and directory sectors on top
+    CHECK(host_readblocks - blocks < BIG_SIZE / 512 + 512, "stream reads each block once");
+    printf("  stream 8M:    %8.1f MB/s, %lu reads, %lu blocks\n", total / t / 1e6, host_reads - cmds,
+           host_readblocks - blocks);
+
+    // the same through the per extent callback
+    fd = fat_open("/Filler Data.bin");
+    CHECK(fd >= 0, "open long name");
+    arg.id = 2;
+    arg.off = arg.pieces = 0;
+    arg.ok = 1;
+    n = fat_readextents(fd, buf, CHUNK, extent_cb, &arg);
+    fat_close(fd);
+    CHECK(arg.ok && n == FILLER_SIZE, "fat_readextents");
+    printf("  extents:      %8u pieces\n", arg.pieces);
+
+    // random access
+    CHECK(fat_lookup("/big.bin", &file), "lookup /big.bin");
+    srand(1);
+    cmds = host_reads;
+    t = now();
+    for (i = 0; i < 5000; i++)
+    {
+        off = rand() % BIG_SIZE;
+        len = rand() % 5000;
+        n = fat_pread(&file, off, buf, len);
+        ok &= n == (off + len > BIG_SIZE ? BIG_SIZE - off : len) && verify(1, off, buf, n);
+    }
+    t = now() - t;
+    CHECK(ok, "random fat_pread");
+    printf("  pread random: %8.0f ops/s, %lu reads, %u extents mapped\n", 5000 / t, host_reads - cmds, file.count);
+
+    // the same with a fresh extent map each time, which walks the chain up to
+    // the offset like seeking did before
+    srand(1);
+    cmds = host_reads;
+    t = now();
+    for (i = 0; i < 5000; i++)
+    {
+        off = rand() % BIG_SIZE;
+        len = rand() % 5000;
+        ok &= fat_lookup("/big.bin", &file);
+        n = fat_pread(&file, off, buf, len);
+        ok &= n == (off + len > BIG_SIZE ? BIG_SIZE - off : len) && verify(1, off, buf, n);
+    }
+    t = now() - t;
+    CHECK(ok, "random fat_pread, unmapped");
+    printf("  pread walk:   %8.0f ops/s, %lu reads\n", 5000 / t, host_reads - cmds);
+
+    // whole file into memory the old way, one command per run of clusters
+    CHECK(fat_getcluster("/BIG.BIN") == big_clust, "fat_getcluster");
+    bcache_invalidate();
+    cmds = host_reads;
+    t = now();
+    data = (unsigned char *)fat_readfile(big_clust);
+    t = now() - t;
+    CHECK(verify(1, 0, data, BIG_SIZE), "fat_readfile");
+    printf("  readfile 8M:  %8.1f MB/s, %lu reads for %u clusters\n", BIG_SIZE / t / 1e6, host_reads - cmds,
+           BIG_SIZE / (img_spc * 512));
+
+    CHECK(fat_lookup("/docs/read me first.TXT", &file) && file.size == 5000, "nested long name, any case");
+    CHECK(fat_pread(&file, 0, buf, 6000) == 5000 && verify(3, 0, buf, 5000), "read nested file");
+    CHECK(fat_lookup("/docs/../docs/./README~1.TXT", &file), "dot entries and short alias");
+    CHECK(!fat_lookup("/docs/missing.txt", &file), "missing file");
+    CHECK(!fat_lookup("/big.bin/x", &file), "file used as directory");
+
+    // a small file looked up and read again and again, from a cold sector
+    // cache first and then warm
+    bcache_invalidate();
+    cmds = host_reads;
+    t = now();
+    ok = fat_lookup("/docs/read me first.TXT", &file) && fat_pread(&file, 0, buf, 5000) == 5000;
+    t = now() - t;
+    printf("  cold read:    %8.2f us, %lu reads\n", t * 1e6, host_reads - cmds);
+    cmds = host_reads;
+    t = now();
+    for (i = 0; i < 1000; i++)
+        ok &= fat_lookup("/docs/read me first.TXT", &file) && fat_pread(&file, 0, buf, 5000) == 5000;
+    t = now() - t;
+    CHECK(ok && verify(3, 0, buf, 5000), "repeated reads");
+    printf("  warm read:    %8.2f us, %lu reads in 1000\n", t / 1000 * 1e6, host_reads - cmds);
+
+    // sequential up to the last block, the read-ahead runs off the card
+    bcache_invalidate();
+    n = host_sdblocks();
+    for (ok = 1, i = n - 16; i < n; i++)
+        ok &= bcache_read(i, buf, 1) == 512;
+    CHECK(ok, "read-ahead at the end of the card");
+
+    bcache_stats(&hits, &misses, &ra);
+    printf("  bcache:       %8u hits, %u misses, %u read ahead\n", hits, misses, ra);
+}
+
+static void test_lookup()
+{
+    unsigned int i, k, ok = 1;
+    fat_file_t file;
+    char name[80];
+    double t;
+
+    // first pass builds the directory index
+    t = now();
+    CHECK(fat_lookup("/many/long file name number 00000.dat", &file), "first lookup");
+    t = now() - t;
+    printf("  index %u:   %8.1f us\n", MANY, t * 1e6);
+    t = now();
+    for (i = 0; i < MANY; i++)
+    {
+        k = (i * 7919) % MANY;
+        // odd ones by long name in another case, even ones by short name
+        sprintf(name, i & 1 ? "/many/LONG FILE NAME NUMBER %05u.DAT" : "/many/L%07u.dat", k);
+        ok &= fat_lookup(name, &file) && file.size == many_size(k) && fat_pread(&file, 0, buf, 1000) == file.size &&
+              verify(100 + k, 0, buf, file.size);
+    }
+    t = now() - t;
+    CHECK(ok, "lookups in /many");
+    printf("  lookup+read:  %8.2f us each\n", t / MANY * 1e6);
+}
+
+static void test_write(char *path)
+{
+    unsigned int before, after, n, i, total, len;
+    unsigned long cmds, blocks;
+    int fd, mirrored;
+    fat_file_t file;
+    double t;
+
+    before = img_freecount(path, &mirrored);
+    fd = fat_create("/new.dat");
+    CHECK(fd >= 0, "create /new.dat");
+    CHECK(fat_create("/NEW.DAT") < 0, "create existing");
+    CHECK(fat_create("/a long name.txt") < 0, "create long name");
+    cmds = host_writes;
+    blocks = host_writeblocks;
+    // only the writes are timed, not making up the pattern
+    for (total = 0, i = 0, t = 0; total < 3000000; total += n, i++)
+    {
+        len = 1 + (i * 7777) % CHUNK;
+        for (n = 0; n < len; n++)
+            wbuf[n] = pat(9, total + n);
+        t -= now();
+        n = fat_write(fd, wbuf, len);
+        t += now();
+        CHECK(n == len, "append");
+    }
+    CHECK(!fat_delete("/new.dat"), "delete open file");
+    t -= now();
+    fat_close(fd);
+    t += now();
+    printf("  append 3M:    %8.1f MB/s, %lu writes, %lu blocks\n", total / t / 1e6, host_writes - cmds,
+           host_writeblocks - blocks);
+    CHECK(fat_lookup("/new.dat", &file) && file.size == total, "size after close");
+    CHECK(file.count < 8, "appended data stays contiguous");
+    for (i = 0; i < total; i += n)
+    {
+        n = fat_pread(&file, i, buf, CHUNK);
+        if (!n || !verify(9, i, buf, n))
+            break;
+    }
+    CHECK(i == total, "read back");
+
+    fd = fat_open("/new.dat");
+    CHECK(fat_truncate(fd, 1234567), "truncate");
+    fat_close(fd);
+    CHECK(fat_lookup("/new.dat", &file) && file.size == 1234567, "size after truncate");
+    CHECK(fat_pread(&file, 1234000, buf, CHUNK) == 567 && verify(9, 1234000, buf, 567), "tail after truncate");
+
+    // growing a full directory cluster, the index of /many follows along
+    t = now();
+    for (i = 0; i < 40; i++)
+    {
+        sprintf((char *)buf, "/many/X%07u.TXT", i);
+        fd = fat_create((char *)buf);
+        CHECK(fd >= 0 && fat_write(fd, (unsigned char *)"hello", 5) == 5, "create in /many");
+        fat_close(fd);
+    }
+    CHECK(fat_lookup("/many/x0000039.txt", &file) && file.size == 5, "lookup created");
+    for (i = 0; i < 40; i++)
+    {
+        sprintf((char *)buf, "/many/X%07u.TXT", i);
+        CHECK(fat_delete((char *)buf), "delete created");
+    }
+    t = now() - t;
+    CHECK(!fat_lookup("/many/x0000039.txt", &file), "created gone after delete");
+    CHECK(fat_lookup("/many/long file name number 01999.dat", &file) && file.size == many_size(1999),
+          "others stay after delete");
+    printf("  create+del:   %8.2f us each\n", t / 40 * 1e6);
+    CHECK(fat_delete("/new.dat"), "delete");
+    CHECK(!fat_lookup("/new.dat", &file), "gone after delete");
+    CHECK(fat_sync(), "sync");
+
+    after = img_freecount(path, &mirrored);
+    CHECK(mirrored, "FATs mirrored");
+    // /many keeps the clusters it grew by
+    CHECK(after <= before && before - after <= 40 / (img_spc * 16) + 1, "no leaked clusters");
+    if (img_fat32)
+        CHECK(img_fsinfo(path) == after, "FSInfo free count");
+}
+
+int main(int argc, char **argv)
+{
+    char path[256];
+    unsigned int i;
+    double t;
+
+    setvbuf(stdout, 0, _IONBF, 0);
+    for (i = 0; i < sizeof(configs) / sizeof(configs[0]); i++)
+    {
+        sprintf(path, "%s/%s.img", argc > 1 ? argv[1] : "/tmp", configs[i].name);
+        printf("%s\n", configs[i].name);
+        t = now();
+        mkimage(&configs[i], path);
+        printf("  generated in  %8.1f ms\n", (now() - t) * 1e3);
+        if (!host_sdopen(path))
+            return 1;
+        bcache_invalidate();
+        CHECK(fat_getpartition(), "mount");
+        test_read(path);
+        test_lookup();
+        test_write(path);
+        host_sdclose();
+    }
+    printf(fails ? "%d checks FAILED\n" : "all checks passed\n", fails);
+    return fails != 0;
+}
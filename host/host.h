@@ -0,0 +1,7 @@
+/* file-backed SD card for the host build, see sd.c */
+int host_sdopen(char *path);
+void host_sdclose();
+unsigned int host_sdblocks();
+
+/* commands and blocks that went to the "card" */
+extern unsigned long host_reads, host_readblocks, host_writes, host_writeblocks;
@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "sd.h"
+#include "host.h"
+
+static int host_fd = -1;
+unsigned long host_reads, host_readblocks, host_writes, host_writeblocks;
+
+/**
+ * Use a disk image as the SD card
+ */
+int host_sdopen(char *path)
+{
+    host_sdclose();
+    if ((host_fd = open(path, O_RDWR)) < 0)
+    {
+        perror(path);
+        return 0;
+    }
+    host_reads = host_readblocks = host_writes = host_writeblocks = 0;
+    return 1;
+}
+
+/**
+ * Eject the card
+ */
+void host_sdclose()
+{
+    if (host_fd >= 0)
+        close(host_fd);
+    host_fd = -1;
+}
+
+/**
+ * Size of the card in blocks
+ */
+unsigned int host_sdblocks()
+{
+    return host_fd >= 0 ? lseek(host_fd, 0, SEEK_END) / 512 : 0;
+}
+
+/**
+ * The image is always ready
+ */
+int sd_init()
+{
+    return host_fd >= 0 ? SD_OK : SD_ERROR;
+}
+
+/**
+ * read num blocks from the image, same contract as the EMMC driver
+ */
+int sd_readblock(unsigned int lba, unsigned char *buffer, unsigned int num)
+{
+    if (num < 1)
+        num = 1;
+    host_reads++;
+    host_readblocks += num;
+    if (pread(host_fd, buffer, num * 512, (off_t)lba * 512) != num * 512)
+        return 0;
+    return num * 512;
+}
+
+/**
+ * write num blocks to the image, same contract as the EMMC driver
+ */
+int sd_writeblock(unsigned int lba, unsigned char *buffer, unsigned int num)
+{
+    if (num < 1)
+        num = 1;
+    host_writes++;
+    host_writeblocks += num;
+    if (pwrite(host_fd, buffer, num * 512, (off_t)lba * 512) != num * 512)
+        return 0;
+    return num * 512;
+}
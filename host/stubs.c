@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include "uart.h"
+#include "lock.h"
+#include "log.h"
+
+// fat_readfile() drops files right after the kernel, give it room. The host
+// linker defines its own _end, the Makefile renames ours to host_end
+unsigned char _end[16 << 20] __attribute__((aligned(64)));
+
+/**
+ * The console is stdout
+ */
+void uart_send(unsigned int c)
+{
+    putchar(c);
+}
+
+void uart_puts(char *s)
+{
+    fputs(s, stdout);
+}
+
+void uart_hex(unsigned int d)
+{
+    printf("%08X", d);
+}
+
+void log_hex(char *s, unsigned int v)
+{
+    printf("%s%08X\n", s, v);
+}
+
+/**
+ * The harness is single threaded, and traces go straight to stderr
+ */
+void trace_record(char *s, unsigned int a, unsigned int b)
+{
+    fprintf(stderr, "%s %08X %08X\n", s, a, b);
+}
+
+void trace_dump()
+{
+}
+
+void spin_lock(spinlock_t *l)
+{
+    *l = 1;
+}
+
+int spin_trylock(spinlock_t *l)
+{
+    return !*l && (*l = 1);
+}
+
+void spin_unlock(spinlock_t *l)
+{
+    *l = 0;
+}
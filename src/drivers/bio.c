@@ -0,0 +1,212 @@
+#include "sd.h"
+#include "irq.h"
+#include "lock.h"
+#include "log.h"
+#include "bio.h"
+
+// most blocks one command can move
+#define BIO_MAXBLOCKS 65535
+
+static bio_t *bio_queue;        // waiting requests sorted by LBA
+static bio_t *bio_inflight;     // the requests merged into the transfer on the bus
+static unsigned int bio_head;   // where the last transfer ended, the elevator sweeps up from here
+static spinlock_t bio_lock;
+static unsigned char *bio_bufs[SD_MAXSEGS];
+static unsigned int bio_cnts[SD_MAXSEGS];
+
+/**
+ * Hand a list of finished requests back to their owners
+ */
+static void bio_complete(bio_t *list, int status)
+{
+    bio_t *b;
+    while (list)
+    {
+        b = list;
+        list = b->next;
+        b->next = 0;
+        b->status = status;
+        if (b->done)
+            b->done(b, b->arg);
+    }
+    // wake up bio_wait()
+    asm volatile("dsb sy; sev");
+}
+
+static bio_t *bio_dispatch();
+static void bio_sync(bio_t *list);
+
+/**
+ * The transfer on the bus finished, start the next one before completing
+ */
+static void bio_done(int status, void *arg)
+{
+    bio_t *list, *sync;
+    spin_lock(&bio_lock);
+    list = bio_inflight;
+    bio_inflight = 0;
+    sync = bio_dispatch();
+    spin_unlock(&bio_lock);
+    bio_complete(list, status);
+    bio_sync(sync);
+}
+
+/**
+ * Put the next requests on the bus if it's idle. The lock must be held.
+ * Returns the requests that can't go asynchronously, they keep the bus
+ * (bio_inflight) and the caller has to pass them to bio_sync() once it
+ * released the lock.
+ */
+static bio_t *bio_dispatch()
+{
+    bio_t *b, *prev, *first, *last;
+    unsigned int num, segs;
+
+    while (!bio_inflight && bio_queue)
+    {
+        // C-LOOK: the first request at or above the head, or wrap around to the lowest
+        for (prev = 0, b = bio_queue; b && b->lba < bio_head; prev = b, b = b->next)
+            ;
+        if (!b)
+        {
+            prev = 0;
+            b = bio_queue;
+        }
+        // followed by the ones continuing it in the same direction
+        first = last = b;
+        num = b->num;
+        segs = 1;
+        while ((b = last->next) && b->write == first->write && b->lba == last->lba + last->num &&
+               segs < SD_MAXSEGS && num + b->num <= BIO_MAXBLOCKS)
+        {
+            last = b;
+            num += b->num;
+            segs++;
+        }
+        if (prev)
+            prev->next = last->next;
+        else
+            bio_queue = last->next;
+        last->next = 0;
+        // buffers that continue each other make one DMA segment
+        for (segs = 0, b = first; b; b = b->next)
+        {
+            if (segs && bio_bufs[segs - 1] + bio_cnts[segs - 1] * 512 == b->buffer)
+                bio_cnts[segs - 1] += b->num;
+            else
+            {
+                bio_bufs[segs] = b->buffer;
+                bio_cnts[segs++] = b->num;
+            }
+        }
+        bio_head = first->lba + num;
+        bio_inflight = first;
+        log_trace("bio_dispatch lba, num", first->lba, num);
+        // no DMA, a byte addressed card or an odd buffer: the slow way
+        return sd_submit(first->lba, segs, bio_bufs, bio_cnts, first->write, bio_done, 0) == SD_OK ? 0 : first;
+    }
+    return 0;
+}
+
+/**
+ * Serve requests bio_dispatch() couldn't start with the lock released, so
+ * their callbacks run without it like after a DMA transfer. Each one stays
+ * in bio_inflight for the overlap check until it's done, the last one
+ * frees the bus and starts the rest of the queue.
+ */
+static void bio_sync(bio_t *list)
+{
+    bio_t *b;
+    unsigned long flags;
+    int r;
+
+    while ((b = list))
+    {
+        r = b->write ? sd_writeblock(b->lba, b->buffer, b->num) : sd_readblock(b->lba, b->buffer, b->num);
+        flags = irq_save();
+        spin_lock(&bio_lock);
+        list = bio_inflight = b->next;
+        if (!list)
+            list = bio_dispatch();
+        spin_unlock(&bio_lock);
+        irq_restore(flags);
+        b->next = 0;
+        bio_complete(b, r == (int)b->num * 512 ? SD_OK : SD_ERROR);
+    }
+}
+
+/**
+ * Queue a request and return without waiting for it. Requests are served in
+ * elevator order, neighbouring ones in the same direction with one command.
+ * Requests overlapping a queued one must not overtake it, so those wait
+ * for the queue to drain first (don't submit them from a completion callback).
+ */
+void bio_submit(bio_t *bio)
+{
+    bio_t **p, *b, *sync;
+    unsigned long flags;
+    int overlap;
+
+    if (bio->num < 1)
+        bio->num = 1;
+    bio->status = BIO_PENDING;
+    bio->next = 0;
+    for (;;)
+    {
+        flags = irq_save();
+        spin_lock(&bio_lock);
+        for (overlap = 0, b = bio_inflight; b && !overlap; b = b->next)
+            overlap = bio->lba < b->lba + b->num && b->lba < bio->lba + bio->num;
+        for (b = bio_queue; b && !overlap; b = b->next)
+            overlap = bio->lba < b->lba + b->num && b->lba < bio->lba + bio->num;
+        if (!overlap)
+            break;
+        spin_unlock(&bio_lock);
+        irq_restore(flags);
+        bio_drain();
+    }
+    // after the ones with the same LBA, they stay in submission order
+    for (p = &bio_queue; *p && (*p)->lba <= bio->lba; p = &(*p)->next)
+        ;
+    bio->next = *p;
+    *p = bio;
+    sync = bio_dispatch();
+    spin_unlock(&bio_lock);
+    irq_restore(flags);
+    bio_sync(sync);
+}
+
+/**
+ * Returns BIO_PENDING while the request is in the queue, SD_OK or an error afterwards
+ */
+int bio_poll(bio_t *bio)
+{
+    return bio->status;
+}
+
+/**
+ * Sleep until the request finished. Returns SD_OK or an error
+ */
+int bio_wait(bio_t *bio)
+{
+    unsigned long daif;
+    asm volatile("mrs %0, daif" : "=r"(daif));
+    while (bio->status == BIO_PENDING)
+    {
+        // the completion does sev, but with interrupts masked nobody runs it
+        if (!(daif & (1 << 7)))
+            asm volatile("wfe");
+        else
+            sd_poll();
+    }
+    return bio->status;
+}
+
+/**
+ * Wait until every queued request finished
+ */
+void bio_drain()
+{
+    while (bio_queue || bio_inflight)
+        sd_poll();
+}
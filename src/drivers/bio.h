@@ -0,0 +1,24 @@
+#define BIO_PENDING 1
+
+typedef struct bio_s bio_t;
+
+/* called when a request finished, from the EMMC interrupt */
+typedef void (*bio_fn)(bio_t *bio, void *arg);
+
+/* block I/O request, belongs to the queue from bio_submit() until it's completed */
+struct bio_s
+{
+    unsigned int lba;
+    unsigned int num;
+    unsigned char *buffer;  // 64 byte aligned for DMA, otherwise served synchronously
+    int write;
+    bio_fn done;            // may be 0
+    void *arg;
+    volatile int status;    // BIO_PENDING, then SD_OK or an error
+    bio_t *next;
+};
+
+void bio_submit(bio_t *bio);
+int bio_poll(bio_t *bio);
+int bio_wait(bio_t *bio);
+void bio_drain();
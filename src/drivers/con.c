@@ -0,0 +1,239 @@
+#include "lfb.h"
+#include "lock.h"
+#include "irq.h"
+#include "con.h"
+
+// lines kept for scrollback, power of two, and the widest screen in cells
+#ifndef CON_LINES
+#define CON_LINES 256
+#endif
+#define CON_COLS 256
+
+#define CON_FG 0xC0C0C0
+#define CON_BG 0x000000
+
+/* the text lives in a ring of lines, line n is con_text[n % CON_LINES].
+   con_write() only changes the ring and marks the columns it touched, the
+   screen catches up in con_flush() */
+static unsigned char con_text[CON_LINES][CON_COLS];
+// changed columns of each line, dmin >= dmax if the line is clean
+static unsigned short con_dmin[CON_LINES], con_dmax[CON_LINES];
+static unsigned int con_cols, con_rows, con_cw, con_ch;
+// cursor: the line it's on (counts up forever) and the column
+static unsigned int con_line, con_x;
+// lines scrolled back from the bottom
+static unsigned int con_back;
+// as drawn: the line at the top of the screen, the cursor, -1 if nothing is
+static unsigned int con_top = -1, con_cline, con_cx;
+static spinlock_t con_lock, con_drawlock;
+static int con_ready = 0;
+
+/**
+ * Mark columns [from, to) of a line for redrawing, with con_lock held
+ */
+static void con_dirty(unsigned int line, unsigned int from, unsigned int to)
+{
+    line %= CON_LINES;
+    if (con_dmin[line] >= con_dmax[line])
+    {
+        con_dmin[line] = from;
+        con_dmax[line] = to;
+        return;
+    }
+    if (from < con_dmin[line])
+        con_dmin[line] = from;
+    if (to > con_dmax[line])
+        con_dmax[line] = to;
+}
+
+/**
+ * Move the cursor to the start of a fresh line, with con_lock held
+ */
+static void con_newline()
+{
+    unsigned int i;
+    con_line++;
+    con_x = 0;
+    // the oldest line of the ring becomes the new one
+    for (i = 0; i < con_cols; i++)
+        con_text[con_line % CON_LINES][i] = ' ';
+    con_dirty(con_line, 0, con_cols);
+}
+
+/**
+ * Set up the cell grid for the screen lfb_init() gave us and clear it
+ */
+void con_init()
+{
+    unsigned int w, h, i, j;
+    lfb_size(&con_cw, &con_ch, &w, &h);
+    if (!con_cw || !con_ch || !w)
+        return;
+    con_cols = w / con_cw < CON_COLS ? w / con_cw : CON_COLS;
+    con_rows = h / con_ch;
+    for (i = 0; i < CON_LINES; i++)
+    {
+        for (j = 0; j < con_cols; j++)
+            con_text[i][j] = ' ';
+        con_dmin[i] = con_dmax[i] = 0;
+    }
+    con_line = con_x = con_back = 0;
+    // nothing drawn yet, the first flush paints the whole screen
+    con_top = -1;
+    con_ready = 1;
+}
+
+/**
+ * Put text in the grid. Doesn't touch the screen, so it's cheap and safe
+ * from interrupt handlers and any core, made to be the UART mirror hook.
+ */
+void con_write(const char *s, unsigned int len)
+{
+    unsigned long flags;
+    unsigned int start;
+    if (!con_ready)
+        return;
+    flags = irq_save();
+    spin_lock(&con_lock);
+    for (start = con_x; len; len--, s++)
+    {
+        if (*s == '\n' || *s == '\r' || *s == '\t' || con_x >= con_cols)
+        {
+            if (con_x > start)
+                con_dirty(con_line, start, con_x);
+            if (*s == '\n' || con_x >= con_cols)
+                con_newline();
+            if (*s == '\r')
+                con_x = 0;
+            if (*s == '\t')
+                con_x = (con_x + 8) & ~7;
+            start = con_x;
+            if (*s == '\n' || *s == '\r' || *s == '\t')
+                continue;
+        }
+        if (*s == '\b')
+        {
+            if (con_x > start)
+                con_dirty(con_line, start, con_x);
+            if (con_x)
+                con_x--;
+            start = con_x;
+            continue;
+        }
+        con_text[con_line % CON_LINES][con_x++] = (unsigned char)*s;
+    }
+    if (con_x > start)
+        con_dirty(con_line, start, con_x < con_cols ? con_x : con_cols);
+    spin_unlock(&con_lock);
+    irq_restore(flags);
+}
+
+/**
+ * Put text in the grid and show it. Not from interrupt handlers, see con_flush()
+ */
+void con_puts(char *s)
+{
+    unsigned int n;
+    for (n = 0; s[n]; n++)
+        ;
+    con_write(s, n);
+    con_flush();
+}
+
+/**
+ * Look at older lines, 0 returns to the bottom
+ */
+void con_scrollback(unsigned int lines)
+{
+    unsigned long flags = irq_save();
+    spin_lock(&con_lock);
+    con_back = lines;
+    spin_unlock(&con_lock);
+    irq_restore(flags);
+}
+
+/**
+ * Bring the screen up to date with the grid: scroll it by the lines added
+ * since the last call in one go, then draw only the cells that changed.
+ * Draws with the SIMD registers, so not from interrupt handlers.
+ */
+void con_flush()
+{
+    unsigned char cells[CON_COLS];
+    unsigned int top, oldest, r, i, line, from, to, cline, cx;
+    unsigned long flags;
+
+    if (!con_ready || !spin_trylock(&con_drawlock))
+        return;
+    flags = irq_save();
+    spin_lock(&con_lock);
+    // the line at the top of the screen, the cursor on the bottom row once the screen is full
+    top = con_line + 1 > con_rows ? con_line + 1 - con_rows : 0;
+    oldest = con_line + 1 > CON_LINES ? con_line + 1 - CON_LINES : 0;
+    top = top - oldest > con_back ? top - con_back : oldest;
+    cline = con_line;
+    cx = con_x < con_cols ? con_x : con_cols - 1;
+    spin_unlock(&con_lock);
+    irq_restore(flags);
+
+    lfb_color(CON_FG, CON_BG);
+    if (top != con_top)
+    {
+        // what's still on the screen moves up and only the new lines get
+        // drawn, unless this is the first time or a jump in the scrollback
+        if (con_top != (unsigned int)-1 && top > con_top && top - con_top < con_rows)
+        {
+            lfb_scroll((top - con_top) * con_ch, CON_BG);
+            from = con_top + con_rows;
+        }
+        else
+        {
+            lfb_fill(CON_BG);
+            from = top;
+        }
+        flags = irq_save();
+        spin_lock(&con_lock);
+        for (line = from; line < top + con_rows; line++)
+            con_dirty(line, 0, con_cols);
+        spin_unlock(&con_lock);
+        irq_restore(flags);
+        con_top = top;
+    }
+    // the cursor cell is drawn inverted, put back the old one
+    if (con_cline != cline || con_cx != cx)
+    {
+        flags = irq_save();
+        spin_lock(&con_lock);
+        con_dirty(con_cline, con_cx, con_cx + 1);
+        con_dirty(cline, cx, cx + 1);
+        spin_unlock(&con_lock);
+        irq_restore(flags);
+    }
+    for (r = 0; r < con_rows; r++)
+    {
+        line = top + r;
+        // take the changed cells, a writer may dirty the line again meanwhile
+        flags = irq_save();
+        spin_lock(&con_lock);
+        from = con_dmin[line % CON_LINES];
+        to = con_dmax[line % CON_LINES];
+        if (line > cline)
+            from = to = 0;
+        for (i = from; i < to; i++)
+            cells[i] = con_text[line % CON_LINES][i];
+        con_dmin[line % CON_LINES] = con_dmax[line % CON_LINES] = 0;
+        spin_unlock(&con_lock);
+        irq_restore(flags);
+        for (i = from; i < to; i++)
+        {
+            if (line == cline && i == cx)
+                lfb_color(CON_BG, CON_FG);
+            lfb_putc(i * con_cw, r * con_ch, cells[i]);
+            if (line == cline && i == cx)
+                lfb_color(CON_FG, CON_BG);
+        }
+    }
+    con_cline = cline;
+    con_cx = cx;
+    spin_unlock(&con_drawlock);
+}
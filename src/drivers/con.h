@@ -0,0 +1,5 @@
+void con_init();
+void con_write(const char *s, unsigned int len);
+void con_puts(char *s);
+void con_flush();
+void con_scrollback(unsigned int lines);
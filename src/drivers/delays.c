@@ -1,7 +1,9 @@
 #include "gpio.h"
 
+#define SYSTMR_CS ((volatile unsigned int *)(MMIO_BASE + 0x00003000))
 #define SYSTMR_LO ((volatile unsigned int *)(MMIO_BASE + 0x00003004))
 #define SYSTMR_HI ((volatile unsigned int *)(MMIO_BASE + 0x00003008))
+#define SYSTMR_C1 ((volatile unsigned int *)(MMIO_BASE + 0x00003010))
 
 /**
  * Wait N CPU cycles (ARM CPU only)
@@ -64,4 +66,19 @@ void wait_msec_st(unsigned int n)
     if (t)
         while (get_system_timer() - t < n)
             ;
-}
\ No newline at end of file
+}
+/**
+ * Raise IRQ_SYSTIMER1 N microsec from now (compare channel 1, the GPU owns 0 and 2)
+ */
+void systimer_arm(unsigned int n)
+{
+    *SYSTMR_C1 = *SYSTMR_LO + n;
+}
+
+/**
+ * Acknowledge IRQ_SYSTIMER1, it stays pending until this is done
+ */
+void systimer_ack()
+{
+    *SYSTMR_CS = 1 << 1;
+}
@@ -1,4 +1,6 @@
 void wait_cycles(unsigned int n);
 void wait_msec(unsigned int n);
 unsigned long get_system_timer();
-void wait_msec_st(unsigned int n);
\ No newline at end of file
+void wait_msec_st(unsigned int n);
+void systimer_arm(unsigned int n);
+void systimer_ack();
\ No newline at end of file
@@ -0,0 +1,195 @@
+#include "gpio.h"
+#include "mbox.h"
+#include "mmu.h"
+#include "lock.h"
+#include "irq.h"
+#include "dma.h"
+
+#define DMA_BASE (MMIO_BASE + 0x00007000)
+#define DMA_CS(ch) ((volatile unsigned int *)(DMA_BASE + (unsigned long)(ch) * 0x100 + 0x00))
+#define DMA_CONBLK_AD(ch) ((volatile unsigned int *)(DMA_BASE + (unsigned long)(ch) * 0x100 + 0x04))
+#define DMA_DEBUG(ch) ((volatile unsigned int *)(DMA_BASE + (unsigned long)(ch) * 0x100 + 0x20))
+#define DMA_INT_STATUS ((volatile unsigned int *)(DMA_BASE + 0x00000FE0))
+#define DMA_ENABLE ((volatile unsigned int *)(DMA_BASE + 0x00000FF0))
+
+// control and status bits
+#define CS_ACTIVE (1 << 0)
+#define CS_END (1 << 1)
+#define CS_INT (1 << 2)
+#define CS_ERROR (1 << 8)
+#define CS_PRIORITY(x) ((x) << 16)
+#define CS_PANIC_PRIORITY(x) ((x) << 20)
+#define CS_WAIT_WRITES (1 << 28)
+#define CS_RESET (1 << 31)
+// debug register error bits, write 1 to clear
+#define DEBUG_ERRORS 0x7
+
+// channels 0-6 are full channels, 7-14 lite (64K max, no 2D), 11-14 share an IRQ
+#define DMA_CHANNELS 11
+#define DMA_FULL_CHANNELS 0x7F
+
+// ARM physical to VideoCore bus addresses: uncached RAM alias and peripherals
+#define BUS_RAM 0xC0000000
+#define BUS_IO 0x7E000000
+
+static spinlock_t dma_lock;
+static volatile int dma_inited = 0;
+// channels the firmware lets us use and the ones we handed out
+static unsigned int dma_usable, dma_used;
+static dma_fn dma_done[DMA_CHANNELS];
+static void *dma_arg[DMA_CHANNELS];
+static volatile int dma_status[DMA_CHANNELS];
+static volatile int dma_finished[DMA_CHANNELS];
+
+/**
+ * Completion interrupt, one per channel
+ */
+static void dma_irq()
+{
+    unsigned int s = *DMA_INT_STATUS & dma_used;
+    int ch;
+    while (s)
+    {
+        ch = __builtin_ctz(s);
+        s &= s - 1;
+        // acknowledge
+        *DMA_CS(ch) = CS_INT | CS_END;
+        dma_status[ch] = (*DMA_DEBUG(ch) & DEBUG_ERRORS) || (*DMA_CS(ch) & CS_ERROR) ? DMA_ERROR : DMA_OK;
+        dma_finished[ch] = 1;
+        if (dma_done[ch])
+            dma_done[ch](ch, dma_status[ch], dma_arg[ch]);
+    }
+    // wake up everybody sleeping in dma_wait()
+    asm volatile("dsb sy\n sev");
+}
+
+/**
+ * Allocate a DMA channel, preferring full ones. Returns the channel or DMA_NOCHANNEL
+ */
+int dma_alloc()
+{
+    unsigned int free;
+    int ch = DMA_NOCHANNEL;
+
+    spin_lock(&dma_lock);
+    if (!dma_inited)
+    {
+        // ask the firmware which channels it doesn't use
+        mbox[0] = 7 * 4;
+        mbox[1] = MBOX_REQUEST;
+        mbox[2] = 0x60001; // get DMA channels
+        mbox[3] = 4;
+        mbox[4] = 0;
+        mbox[5] = 0;
+        mbox[6] = MBOX_TAG_LAST;
+        dma_usable = mbox_call(MBOX_CH_PROP) ? mbox[5] : 0x7F35;
+        dma_usable &= (1 << DMA_CHANNELS) - 1;
+        dma_inited = 1;
+    }
+    free = dma_usable & ~dma_used;
+    if (free)
+    {
+        ch = __builtin_ctz(free & DMA_FULL_CHANNELS ? free & DMA_FULL_CHANNELS : free);
+        dma_used |= 1 << ch;
+        *DMA_ENABLE |= 1 << ch;
+        *DMA_CS(ch) = CS_RESET;
+        dma_finished[ch] = 1;
+        irq_register(IRQ_DMA0 + ch, dma_irq);
+    }
+    spin_unlock(&dma_lock);
+    return ch;
+}
+
+/**
+ * Give a channel back
+ */
+void dma_free(int ch)
+{
+    if (ch < 0 || ch >= DMA_CHANNELS)
+        return;
+    spin_lock(&dma_lock);
+    irq_unregister(IRQ_DMA0 + ch);
+    *DMA_CS(ch) = CS_RESET;
+    dma_used &= ~(1 << ch);
+    spin_unlock(&dma_lock);
+}
+
+/**
+ * Bus address of a RAM buffer as the DMA engine sees it
+ */
+unsigned int dma_busaddr(void *ptr)
+{
+    return ((unsigned int)(unsigned long)ptr & 0x3FFFFFFF) | BUS_RAM;
+}
+
+/**
+ * Bus address of a peripheral register
+ */
+unsigned int dma_ioaddr(volatile unsigned int *reg)
+{
+    return ((unsigned int)(unsigned long)reg - MMIO_BASE) | BUS_IO;
+}
+
+/**
+ * Start a control block chain on a channel. done is called from the
+ * interrupt when the chain finished, it may be 0 if the caller uses dma_wait().
+ * Buffer cache maintenance is up to the caller, the control blocks are cleaned here.
+ */
+void dma_start(int ch, dma_cb_t *cb, dma_fn done, void *arg)
+{
+    dma_cb_t *c;
+
+    for (c = cb; c; c = c->nextconbk ? (dma_cb_t *)(unsigned long)(c->nextconbk & ~BUS_RAM) : 0)
+        dcache_clean(c, sizeof(dma_cb_t));
+    dma_done[ch] = done;
+    dma_arg[ch] = arg;
+    dma_status[ch] = DMA_OK;
+    dma_finished[ch] = 0;
+    *DMA_DEBUG(ch) = DEBUG_ERRORS;
+    *DMA_CONBLK_AD(ch) = dma_busaddr(cb);
+    *DMA_CS(ch) = CS_WAIT_WRITES | CS_PANIC_PRIORITY(15) | CS_PRIORITY(1) | CS_ACTIVE;
+}
+
+/**
+ * Is the channel still transferring?
+ */
+int dma_busy(int ch)
+{
+    return !dma_finished[ch] && !(*DMA_CS(ch) & CS_END);
+}
+
+/**
+ * Sleep until the channel finished. Returns DMA_OK or DMA_ERROR
+ */
+int dma_wait(int ch)
+{
+    unsigned long daif;
+    asm volatile("mrs %0, daif" : "=r"(daif));
+    while (dma_busy(ch))
+    {
+        // the completion interrupt does sev, but only if it can reach core 0
+        if (!(daif & (1 << 7)))
+            asm volatile("wfe");
+        else if (*DMA_CS(ch) & CS_ERROR)
+            break;
+    }
+    if (!dma_finished[ch])
+    {
+        // nobody took the interrupt, finish up here
+        dma_status[ch] = (*DMA_DEBUG(ch) & DEBUG_ERRORS) || (*DMA_CS(ch) & CS_ERROR) ? DMA_ERROR : DMA_OK;
+        *DMA_CS(ch) = CS_INT | CS_END;
+        dma_finished[ch] = 1;
+    }
+    return dma_status[ch];
+}
+
+/**
+ * Stop a transfer that will never finish, for example after the peripheral failed
+ */
+void dma_abort(int ch)
+{
+    *DMA_CS(ch) = CS_RESET;
+    *DMA_DEBUG(ch) = DEBUG_ERRORS;
+    dma_status[ch] = DMA_ERROR;
+    dma_finished[ch] = 1;
+}
@@ -0,0 +1,40 @@
+#define DMA_OK 0
+#define DMA_ERROR -2
+#define DMA_NOCHANNEL -3
+
+/* transfer information bits */
+#define DMA_TI_INTEN (1 << 0)
+#define DMA_TI_WAIT_RESP (1 << 3)
+#define DMA_TI_DEST_INC (1 << 4)
+#define DMA_TI_DEST_WIDTH (1 << 5) // 128 bit writes
+#define DMA_TI_DEST_DREQ (1 << 6)
+#define DMA_TI_SRC_INC (1 << 8)
+#define DMA_TI_SRC_WIDTH (1 << 9) // 128 bit reads
+#define DMA_TI_SRC_DREQ (1 << 10)
+#define DMA_TI_PERMAP(x) ((x) << 16)
+
+/* peripheral DREQ numbers */
+#define DMA_DREQ_EMMC 11
+
+/* control block, the engine reads these from memory, 32 byte aligned */
+typedef struct
+{
+    unsigned int ti;
+    unsigned int source_ad;
+    unsigned int dest_ad;
+    unsigned int txfr_len;
+    unsigned int stride;
+    unsigned int nextconbk;
+    unsigned int reserved[2];
+} __attribute__((aligned(32))) dma_cb_t;
+
+typedef void (*dma_fn)(int ch, int status, void *arg);
+
+int dma_alloc();
+void dma_free(int ch);
+unsigned int dma_busaddr(void *ptr);
+unsigned int dma_ioaddr(volatile unsigned int *reg);
+void dma_start(int ch, dma_cb_t *cb, dma_fn done, void *arg);
+int dma_busy(int ch);
+int dma_wait(int ch);
+void dma_abort(int ch);
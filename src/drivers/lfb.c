@@ -1,6 +1,7 @@
-#include "uart.h"
+#include "log.h"
 #include "mbox.h"
 #include "delays.h"
+#include "lfb.h"
 
 /* PC Screen Font as used by Linux Console */
 typedef struct
@@ -36,11 +37,70 @@ typedef struct
 } __attribute__((packed)) sfn_t;
 extern volatile unsigned char _binary_include_font_sfn_start[];
 
+// pages stacked in the virtual framebuffer, 2 for double, 3 for triple buffering
+#ifndef LFB_PAGES
+#define LFB_PAGES 2
+#endif
+// one refresh at 60 Hz, a page replaced longer ago than this is off the screen
+#define LFB_FRAME_USEC 16667
+
 unsigned int width, height, pitch;
+// the page being drawn, the visible one outside of lfb_begin()/lfb_end()
 unsigned char *lfb;
+static unsigned char *lfb_base;
+static unsigned int lfb_pages = 1, lfb_front, lfb_back;
+// when each page was last flipped away from
+static unsigned long lfb_retired[LFB_PAGES];
+
+// text colours, the background may be LFB_TRANSPARENT
+static unsigned int lfb_fg = 0xFFFFFF, lfb_bg = 0;
+static int lfb_vector = 1;
+
+/* four pixels. This file is built without -mgeneral-regs-only, so gcc uses
+   NEON for these (cmtst, bsl, 128 bit stores). Nothing here may run in an
+   interrupt handler, the IRQ entry doesn't save the SIMD registers. */
+typedef unsigned int lfb_v4_t __attribute__((vector_size(16), aligned(4)));
+static lfb_v4_t lfb_vfg = {0xFFFFFF, 0xFFFFFF, 0xFFFFFF, 0xFFFFFF}, lfb_vbg;
+
+// rasterised SSFN glyphs, tiles are up to 64 pixels wide and LFB_GLYPHH high
+#ifndef LFB_GLYPHS
+#define LFB_GLYPHS 128
+#endif
+#define LFB_GLYPHH 32
+#define LFB_GLYPHHASH 64
+#define LFB_NOGLYPH 0xFFFFFFFF
+
+typedef struct lfb_glyph_s
+{
+    unsigned int c;                 // code point, LFB_NOGLYPH if the tile is free
+    unsigned char top, bottom;      // rows with pixels set
+    unsigned char advx, advy;
+    unsigned char found;            // 0 if the font doesn't have c
+    unsigned long rows[LFB_GLYPHH]; // one bit per pixel, bit 0 leftmost
+    struct lfb_glyph_s *hnext;      // hash chain
+    struct lfb_glyph_s *prev, *next; // LRU list, most recently used at the head
+} lfb_glyph_t;
+
+static lfb_glyph_t lfb_glyphs[LFB_GLYPHS];
+static lfb_glyph_t *lfb_glyphhash[LFB_GLYPHHASH];
+static lfb_glyph_t *lfb_glyphhead, *lfb_glyphtail;
+
+// SSFN code point index: 256 code point pages, a page maps code points to glyph records
+#ifndef LFB_CPPAGES
+#define LFB_CPPAGES 32
+#endif
+#define LFB_CPNONE 0     // no glyphs in the page
+#define LFB_CPSCAN 0xFF  // out of index pages, search the character table
+#if LFB_CPPAGES >= LFB_CPSCAN
+#error "LFB_CPPAGES must stay below LFB_CPSCAN, lfb_cptop keeps page numbers + 1 in a byte"
+#endif
+static unsigned char lfb_cptop[0x110000 >> 8];      // page number + 1
+static unsigned int lfb_cppages[LFB_CPPAGES][256];  // offset in the font, 0 if missing
+static unsigned int lfb_cpascii[128];
+static int lfb_cpused = -1;
 
 /**
- * Set screen resolution to 1024x768
+ * Set screen resolution to 1024x768, with LFB_PAGES pages to draw in
  */
 void lfb_init()
 {
@@ -60,7 +120,7 @@ void lfb_init()
     mbox[8] = 8;
     mbox[9] = 8;
     mbox[10] = 1024; // FrameBufferInfo.virtual_width
-    mbox[11] = 768;  // FrameBufferInfo.virtual_height
+    mbox[11] = 768 * LFB_PAGES; // FrameBufferInfo.virtual_height
 
     mbox[12] = 0x48009; // set virt offset
     mbox[13] = 8;
@@ -97,12 +157,220 @@ void lfb_init()
         width = mbox[5];
         height = mbox[6];
         pitch = mbox[33];
-        lfb = (void *)((unsigned long)mbox[28]);
+        lfb = lfb_base = (void *)((unsigned long)mbox[28]);
+        // the firmware may give less than we asked for
+        lfb_pages = mbox[11] / height;
+        if (lfb_pages > LFB_PAGES)
+            lfb_pages = LFB_PAGES;
+        if (lfb_pages < 1)
+            lfb_pages = 1;
+        lfb_front = lfb_back = 0;
     }
     else
     {
-        uart_puts("Unable to set screen resolution to 1024x768x32\n");
+        log_error("Unable to set screen resolution to 1024x768x32\n");
+    }
+    lfb_cpinit();
+}
+
+/**
+ * Wait for the next vertical sync, or just for usec if the firmware can't tell (QEMU)
+ */
+static void lfb_vsync(unsigned long usec)
+{
+    mbox[0] = 7 * 4;
+    mbox[1] = MBOX_REQUEST;
+    mbox[2] = 0x4800e; // set vsync, returns on the next one
+    mbox[3] = 4;
+    mbox[4] = 4;
+    mbox[5] = 0;
+    mbox[6] = MBOX_TAG_LAST;
+    if (!mbox_call(MBOX_CH_PROP) || !(mbox[4] & 0x80000000))
+        wait_msec(usec);
+}
+
+/**
+ * Start drawing a frame into the next hidden page, lfb points to it until lfb_end()
+ */
+void lfb_begin()
+{
+    unsigned long t;
+    if (lfb_pages < 2)
+        return;
+    lfb_back = (lfb_front + 1) % lfb_pages;
+    // the page may be scanned out until the refresh after it was flipped away
+    t = get_system_timer() - lfb_retired[lfb_back];
+    if (t < LFB_FRAME_USEC)
+        lfb_vsync(LFB_FRAME_USEC - t);
+    lfb = lfb_base + lfb_back * height * pitch;
+}
+
+/**
+ * Scan out the virtual framebuffer from row y, from the next vertical sync on
+ */
+static int lfb_pan(unsigned int y)
+{
+    mbox[0] = 8 * 4;
+    mbox[1] = MBOX_REQUEST;
+    mbox[2] = 0x48009; // set virt offset
+    mbox[3] = 8;
+    mbox[4] = 8;
+    mbox[5] = 0;
+    mbox[6] = y;
+    mbox[7] = MBOX_TAG_LAST;
+    return mbox_call(MBOX_CH_PROP);
+}
+
+/**
+ * Show the page drawn since lfb_begin(). The firmware latches the new offset
+ * at the next vertical sync, so this doesn't wait, the next lfb_begin() does
+ * if it would draw into a page still on the screen.
+ */
+void lfb_end()
+{
+    if (lfb_pages < 2 || lfb_back == lfb_front)
+        return;
+    if (lfb_pan(lfb_back * height))
+    {
+        lfb_retired[lfb_front] = get_system_timer();
+        lfb_front = lfb_back;
+    }
+}
+
+/**
+ * Fill the page being drawn with a colour
+ */
+void lfb_fill(unsigned int color)
+{
+    unsigned long c = ((unsigned long)color << 32) | color, *p, *end;
+    unsigned int y;
+    for (y = 0; y < height; y++)
+        for (p = (unsigned long *)(lfb + y * pitch), end = p + width / 2; p < end; p++)
+            *p = c;
+}
+
+/**
+ * Fill n rows of the page being drawn from row y
+ */
+static void lfb_fillrows(unsigned int y, unsigned int n, unsigned int color)
+{
+    lfb_v4_t c = {color, color, color, color}, *p, *end;
+    for (; n; n--, y++)
+        for (p = (lfb_v4_t *)(lfb + y * pitch), end = p + width / 4; p < end; p++)
+            *p = c;
+}
+
+/**
+ * Move the screen up by n pixel rows and clear the rows coming in at the
+ * bottom. With a spare page below the screen only the virtual offset moves,
+ * the screen is copied back to the top once the spare rows run out. Owns
+ * the pages, don't mix with lfb_begin()/lfb_end().
+ */
+void lfb_scroll(unsigned int n, unsigned int color)
+{
+    unsigned int top = (lfb - lfb_base) / pitch, y;
+    lfb_v4_t *d, *p, *end;
+
+    if (n >= height)
+    {
+        lfb_fillrows(0, height, color);
+        return;
+    }
+    if (lfb_pages > 1 && top + n + height <= lfb_pages * height)
+    {
+        // draw the new rows off the screen, then pan down to them
+        lfb_fillrows(height, n, color);
+        if (lfb_pan(top + n))
+        {
+            lfb += n * pitch;
+            return;
+        }
     }
+    // one bulk move of what stays on the screen to the top of the buffer
+    for (y = n; y < height; y++)
+        for (d = (lfb_v4_t *)(lfb_base + (y - n) * pitch), p = (lfb_v4_t *)(lfb + y * pitch), end = p + width / 4; p < end; p++, d++)
+            *d = *p;
+    if (lfb != lfb_base)
+    {
+        lfb_pan(0);
+        lfb = lfb_base;
+    }
+    lfb_fillrows(height - n, n, color);
+}
+
+/**
+ * Font cell size of lfb_print() and lfb_putc(), and the screen size in pixels
+ */
+void lfb_size(unsigned int *cw, unsigned int *ch, unsigned int *w, unsigned int *h)
+{
+    psf_t *font = (psf_t *)&_binary_include_font_psf_start;
+    *cw = font->width;
+    *ch = font->height;
+    *w = width;
+    *h = height;
+}
+
+/**
+ * Set the text colours, bg LFB_TRANSPARENT leaves the background alone
+ */
+void lfb_color(unsigned int fg, unsigned int bg)
+{
+    lfb_fg = fg;
+    lfb_bg = bg;
+    lfb_vfg = (lfb_v4_t){fg, fg, fg, fg};
+    lfb_vbg = (lfb_v4_t){bg, bg, bg, bg};
+}
+
+/**
+ * Expand PSF glyphs 8 pixels at a time (1) or one pixel at a time (0)
+ */
+void lfb_simd(int on)
+{
+    lfb_vector = on;
+}
+
+/**
+ * Draw one PSF glyph, rows are MSB first
+ */
+static void lfb_psfglyph(psf_t *font, unsigned char *glyph, unsigned char *dst)
+{
+    static const lfb_v4_t lo = {0x80, 0x40, 0x20, 0x10}, hi = {8, 4, 2, 1};
+    unsigned int i, j, *p, bytesperline = (font->width + 7) / 8, w = font->width;
+    lfb_v4_t b, m;
+
+    for (j = 0; j < font->height; j++, glyph += bytesperline, dst += pitch)
+    {
+        p = (unsigned int *)dst;
+        i = 0;
+        if (lfb_vector)
+            for (; i + 8 <= w; i += 8)
+            {
+                // a byte of bits to two masks of four pixels, then select fg or bg
+                b = (lfb_v4_t){glyph[i >> 3], glyph[i >> 3], glyph[i >> 3], glyph[i >> 3]};
+                m = (lfb_v4_t)((b & lo) != 0);
+                *(lfb_v4_t *)(p + i) = (lfb_vfg & m) | ((lfb_bg == LFB_TRANSPARENT ? *(lfb_v4_t *)(p + i) : lfb_vbg) & ~m);
+                m = (lfb_v4_t)((b & hi) != 0);
+                *(lfb_v4_t *)(p + i + 4) = (lfb_vfg & m) | ((lfb_bg == LFB_TRANSPARENT ? *(lfb_v4_t *)(p + i + 4) : lfb_vbg) & ~m);
+            }
+        // the rest of the row, all of it in scalar mode
+        for (; i < w; i++)
+        {
+            if (glyph[i >> 3] & (0x80 >> (i & 7)))
+                p[i] = lfb_fg;
+            else if (lfb_bg != LFB_TRANSPARENT)
+                p[i] = lfb_bg;
+        }
+    }
+}
+
+/**
+ * Draw one PSF character at x, y
+ */
+void lfb_putc(int x, int y, unsigned char c)
+{
+    psf_t *font = (psf_t *)&_binary_include_font_psf_start;
+    lfb_psfglyph(font, (unsigned char *)font + font->headersize + (c < font->numglyph ? c : 0) * font->bytesperglyph,
+                 lfb + y * pitch + x * 4);
 }
 
 /**
@@ -112,16 +380,10 @@ void lfb_print(int x, int y, char *s)
 {
     // get our font
     psf_t *font = (psf_t *)&_binary_include_font_psf_start;
+    unsigned char *glyph;
     // draw next character if it's not zero
     while (*s)
     {
-        // get the offset of the glyph. Need to adjust this to support unicode table
-        unsigned char *glyph = (unsigned char *)&_binary_include_font_psf_start +
-                               font->headersize + (*((unsigned char *)s) < font->numglyph ? *s : 0) * font->bytesperglyph;
-        // calculate the offset on screen
-        int offs = (y * pitch) + (x * 4);
-        // variables
-        int i, j, line, mask, bytesperline = (font->width + 7) / 8;
         // handle carrige return
         if (*s == '\r')
         {
@@ -136,23 +398,10 @@ void lfb_print(int x, int y, char *s)
             }
             else
             {
-                // display a character
-                for (j = 0; j < font->height; j++)
-                {
-                    // display one row
-                    line = offs;
-                    mask = 1 << (font->width - 1);
-                    for (i = 0; i < font->width; i++)
-                    {
-                        // if bit set, we use white color, otherwise black
-                        *((unsigned int *)(lfb + line)) = ((int)*glyph) & mask ? 0xFFFFFF : 0;
-                        mask >>= 1;
-                        line += 4;
-                    }
-                    // adjust to next line
-                    glyph += bytesperline;
-                    offs += pitch;
-                }
+                // get the offset of the glyph. Need to adjust this to support unicode table
+                glyph = (unsigned char *)&_binary_include_font_psf_start +
+                        font->headersize + (*((unsigned char *)s) < font->numglyph ? *(unsigned char *)s : 0) * font->bytesperglyph;
+                lfb_psfglyph(font, glyph, lfb + y * pitch + x * 4);
                 x += (font->width + 1);
             }
         // next character
@@ -160,6 +409,280 @@ void lfb_print(int x, int y, char *s)
     }
 }
 
+/**
+ * Walk the SSFN character table. Calls fn(code point, glyph record) for each
+ * glyph until it returns non-zero, and returns that record
+ */
+static unsigned char *lfb_cpwalk(sfn_t *font, int (*fn)(unsigned int, unsigned char *, void *), void *arg)
+{
+    unsigned char *ptr;
+    int i, j;
+    for (ptr = (unsigned char *)font + font->characters_offs, i = 0; i < 0x110000; i++)
+    {
+        if (ptr[0] == 0xFF)
+        {
+            i += 65535;
+            ptr++;
+        }
+        else if ((ptr[0] & 0xC0) == 0xC0)
+        {
+            j = (((ptr[0] & 0x3F) << 8) | ptr[1]);
+            i += j;
+            ptr += 2;
+        }
+        else if ((ptr[0] & 0xC0) == 0x80)
+        {
+            j = (ptr[0] & 0x3F);
+            i += j;
+            ptr++;
+        }
+        else
+        {
+            if (fn(i, ptr, arg))
+                return ptr;
+            ptr += 6 + ptr[1] * (ptr[0] & 0x40 ? 6 : 5);
+        }
+    }
+    return 0;
+}
+
+/**
+ * lfb_cpwalk() callback, stops at the code point in *arg
+ */
+static int lfb_cpmatch(unsigned int c, unsigned char *chr, void *arg)
+{
+    return c == *(unsigned int *)arg;
+}
+
+/**
+ * lfb_cpwalk() callback, adds a glyph to the index
+ */
+static int lfb_cpadd(unsigned int c, unsigned char *chr, void *arg)
+{
+    unsigned int o = chr - (unsigned char *)arg;
+    if (c < 128)
+        lfb_cpascii[c] = o;
+    if (lfb_cptop[c >> 8] == LFB_CPNONE)
+        lfb_cptop[c >> 8] = lfb_cpused < LFB_CPPAGES ? ++lfb_cpused : LFB_CPSCAN;
+    if (lfb_cptop[c >> 8] != LFB_CPSCAN)
+        lfb_cppages[lfb_cptop[c >> 8] - 1][c & 0xFF] = o;
+    return 0;
+}
+
+/**
+ * Index the font's character table once, so lookups don't have to walk it.
+ * Returns the bytes the index takes, all LFB_CPPAGES pages included.
+ */
+unsigned int lfb_cpinit()
+{
+    sfn_t *font = (sfn_t *)&_binary_include_font_sfn_start;
+    unsigned int i, j;
+    for (i = 0; i < sizeof(lfb_cptop); i++)
+        lfb_cptop[i] = LFB_CPNONE;
+    for (i = 0; i < LFB_CPPAGES; i++)
+        for (j = 0; j < 256; j++)
+            lfb_cppages[i][j] = 0;
+    for (i = 0; i < 128; i++)
+        lfb_cpascii[i] = 0;
+    lfb_cpused = 0;
+    lfb_cpwalk(font, lfb_cpadd, font);
+    // the pages are a static array, all of them take memory whether used or not
+    i = sizeof(lfb_cptop) + sizeof(lfb_cpascii) + sizeof(lfb_cppages);
+    log_infox("SSFN index bytes: ", i);
+    log_infox("SSFN index pages used: ", lfb_cpused);
+    return i;
+}
+
+/**
+ * Find the glyph record of a code point in the SSFN font, 0 if it doesn't have it
+ */
+unsigned char *lfb_findglyph(unsigned int c)
+{
+    unsigned char *font = (unsigned char *)&_binary_include_font_sfn_start;
+    unsigned int o;
+    if (lfb_cpused < 0)
+        lfb_cpinit();
+    if (c < 128)
+        o = lfb_cpascii[c];
+    else if (c >= 0x110000 || lfb_cptop[c >> 8] == LFB_CPNONE)
+        return 0;
+    else if (lfb_cptop[c >> 8] == LFB_CPSCAN)
+        return lfb_cpwalk((sfn_t *)font, lfb_cpmatch, &c);
+    else
+        o = lfb_cppages[lfb_cptop[c >> 8] - 1][c & 0xFF];
+    return o ? font + o : 0;
+}
+
+/**
+ * Uncompress and display a glyph's fragments straight to the screen
+ */
+static void lfb_drawglyph(sfn_t *font, unsigned char *chr, int x, int y)
+{
+    unsigned char *ptr, *frg;
+    unsigned long o, p;
+    int i, j, k, l, m, n;
+
+    ptr = chr + 6;
+    o = (unsigned long)lfb + y * pitch + x * 4;
+    for (i = n = 0; i < chr[1]; i++, ptr += chr[0] & 0x40 ? 6 : 5)
+    {
+        if (ptr[0] == 255 && ptr[1] == 255)
+            continue;
+        frg = (unsigned char *)font + (chr[0] & 0x40 ? ((ptr[5] << 24) | (ptr[4] << 16) | (ptr[3] << 8) | ptr[2]) : ((ptr[4] << 16) | (ptr[3] << 8) | ptr[2]));
+        if ((frg[0] & 0xE0) != 0x80)
+            continue;
+        o += (int)(ptr[1] - n) * pitch;
+        n = ptr[1];
+        k = ((frg[0] & 0x1F) + 1) << 3;
+        j = frg[1] + 1;
+        frg += 2;
+        for (m = 1; j; j--, n++, o += pitch)
+            for (p = o, l = 0; l < k; l++, p += 4, m <<= 1)
+            {
+                if (m > 0x80)
+                {
+                    frg++;
+                    m = 1;
+                }
+                if (*frg & m)
+                    *((unsigned int *)p) = lfb_fg;
+            }
+    }
+}
+
+/**
+ * Uncompress a glyph's fragments into one bit per pixel rows, bit 0 is the
+ * leftmost. Returns 0 if the glyph is larger than a cache tile.
+ */
+static int lfb_rasterise(sfn_t *font, unsigned char *chr, lfb_glyph_t *g)
+{
+    unsigned char *ptr, *frg;
+    unsigned long bits;
+    int i, j, k, l, n;
+
+    for (n = 0; n < LFB_GLYPHH; n++)
+        g->rows[n] = 0;
+    g->top = LFB_GLYPHH;
+    g->bottom = 0;
+    for (i = 0, ptr = chr + 6; i < chr[1]; i++, ptr += chr[0] & 0x40 ? 6 : 5)
+    {
+        if (ptr[0] == 255 && ptr[1] == 255)
+            continue;
+        frg = (unsigned char *)font + (chr[0] & 0x40 ? ((ptr[5] << 24) | (ptr[4] << 16) | (ptr[3] << 8) | ptr[2]) : ((ptr[4] << 16) | (ptr[3] << 8) | ptr[2]));
+        if ((frg[0] & 0xE0) != 0x80)
+            continue;
+        // k / 8 bytes per row, LSB first, j rows from row ptr[1] down
+        k = ((frg[0] & 0x1F) + 1) << 3;
+        j = frg[1] + 1;
+        frg += 2;
+        for (n = ptr[1]; j; j--, n++, frg += k >> 3)
+        {
+            for (bits = 0, l = 0; l < k; l += 8)
+            {
+                if (!frg[l >> 3])
+                    continue;
+                if (l >= 64)
+                    return 0;
+                bits |= (unsigned long)frg[l >> 3] << l;
+            }
+            if (!bits)
+                continue;
+            if (n >= LFB_GLYPHH)
+                return 0;
+            g->rows[n] |= bits;
+            if (n < g->top)
+                g->top = n;
+            if (n >= g->bottom)
+                g->bottom = n + 1;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Put every tile on the LRU list, empty and unhashed
+ */
+void lfb_glyphflush()
+{
+    int i;
+    for (i = 0; i < LFB_GLYPHS; i++)
+    {
+        lfb_glyphs[i].c = LFB_NOGLYPH;
+        lfb_glyphs[i].hnext = 0;
+        lfb_glyphs[i].prev = i ? &lfb_glyphs[i - 1] : 0;
+        lfb_glyphs[i].next = i < LFB_GLYPHS - 1 ? &lfb_glyphs[i + 1] : 0;
+    }
+    for (i = 0; i < LFB_GLYPHHASH; i++)
+        lfb_glyphhash[i] = 0;
+    lfb_glyphhead = &lfb_glyphs[0];
+    lfb_glyphtail = &lfb_glyphs[LFB_GLYPHS - 1];
+}
+
+/**
+ * Move a tile to the head of the LRU list
+ */
+static void lfb_glyphtouch(lfb_glyph_t *g)
+{
+    if (g == lfb_glyphhead)
+        return;
+    g->prev->next = g->next;
+    if (g->next)
+        g->next->prev = g->prev;
+    else
+        lfb_glyphtail = g->prev;
+    g->prev = 0;
+    g->next = lfb_glyphhead;
+    lfb_glyphhead->prev = g;
+    lfb_glyphhead = g;
+}
+
+/**
+ * Get the tile of a code point, rasterising it into the least recently used
+ * one on a miss. Returns 0 if the glyph doesn't fit a tile, *chr is set then.
+ */
+static lfb_glyph_t *lfb_glyph(sfn_t *font, unsigned int c, unsigned char **chr)
+{
+    lfb_glyph_t *g, **pp;
+
+    if (!lfb_glyphhead)
+        lfb_glyphflush();
+    for (g = lfb_glyphhash[c % LFB_GLYPHHASH]; g; g = g->hnext)
+        if (g->c == c)
+        {
+            lfb_glyphtouch(g);
+            return g;
+        }
+    // take the oldest tile off its hash chain
+    g = lfb_glyphtail;
+    if (g->c != LFB_NOGLYPH)
+    {
+        for (pp = &lfb_glyphhash[g->c % LFB_GLYPHHASH]; *pp != g; pp = &(*pp)->hnext)
+            ;
+        *pp = g->hnext;
+        g->c = LFB_NOGLYPH;
+    }
+    *chr = lfb_findglyph(c);
+    if (*chr)
+    {
+        if (!lfb_rasterise(font, *chr, g))
+            return 0;
+        g->advx = (*chr)[4];
+        g->advy = (*chr)[5];
+        g->found = 1;
+    }
+    else
+    {
+        // remember it's missing too, that's the most expensive lookup
+        g->top = g->bottom = g->advx = g->advy = 0;
+        g->found = 0;
+    }
+    g->c = c;
+    g->hnext = lfb_glyphhash[c % LFB_GLYPHHASH];
+    lfb_glyphhash[c % LFB_GLYPHHASH] = g;
+    lfb_glyphtouch(g);
+    return g;
+}
+
 /**
  * Display a string using proportional SSFN
  */
@@ -167,10 +690,11 @@ void lfb_proprint(int x, int y, char *s)
 {
     // get our font
     sfn_t *font = (sfn_t *)&_binary_include_font_sfn_start;
-    unsigned char *ptr, *chr, *frg;
-    unsigned int c;
-    unsigned long o, p;
-    int i, j, k, l, m, n;
+    unsigned char *chr;
+    unsigned int c, *row;
+    unsigned long bits;
+    lfb_glyph_t *g;
+    int j;
 
     while (*s)
     {
@@ -212,67 +736,23 @@ void lfb_proprint(int x, int y, char *s)
                 y += font->height;
                 continue;
             }
-        // find glyph, look up "c" in Character Table
-        for (ptr = (unsigned char *)font + font->characters_offs, chr = 0, i = 0; i < 0x110000; i++)
+        if (!(g = lfb_glyph(font, c, &chr)))
         {
-            if (ptr[0] == 0xFF)
-            {
-                i += 65535;
-                ptr++;
-            }
-            else if ((ptr[0] & 0xC0) == 0xC0)
-            {
-                j = (((ptr[0] & 0x3F) << 8) | ptr[1]);
-                i += j;
-                ptr += 2;
-            }
-            else if ((ptr[0] & 0xC0) == 0x80)
-            {
-                j = (ptr[0] & 0x3F);
-                i += j;
-                ptr++;
-            }
-            else
-            {
-                if ((unsigned int)i == c)
-                {
-                    chr = ptr;
-                    break;
-                }
-                ptr += 6 + ptr[1] * (ptr[0] & 0x40 ? 6 : 5);
-            }
-        }
-        if (!chr)
+            // too big for a tile, the slow way
+            lfb_drawglyph(font, chr, x, y);
+            x += chr[4] + 1;
+            y += chr[5];
             continue;
-        // uncompress and display fragments
-        ptr = chr + 6;
-        o = (unsigned long)lfb + y * pitch + x * 4;
-        for (i = n = 0; i < chr[1]; i++, ptr += chr[0] & 0x40 ? 6 : 5)
-        {
-            if (ptr[0] == 255 && ptr[1] == 255)
-                continue;
-            frg = (unsigned char *)font + (chr[0] & 0x40 ? ((ptr[5] << 24) | (ptr[4] << 16) | (ptr[3] << 8) | ptr[2]) : ((ptr[4] << 16) | (ptr[3] << 8) | ptr[2]));
-            if ((frg[0] & 0xE0) != 0x80)
-                continue;
-            o += (int)(ptr[1] - n) * pitch;
-            n = ptr[1];
-            k = ((frg[0] & 0x1F) + 1) << 3;
-            j = frg[1] + 1;
-            frg += 2;
-            for (m = 1; j; j--, n++, o += pitch)
-                for (p = o, l = 0; l < k; l++, p += 4, m <<= 1)
-                {
-                    if (m > 0x80)
-                    {
-                        frg++;
-                        m = 1;
-                    }
-                    if (*frg & m)
-                        *((unsigned int *)p) = 0xFFFFFF;
-                }
         }
+        if (!g->found)
+            continue;
+        // only the set pixels are stored, one per bit
+        row = (unsigned int *)(lfb + (y + g->top) * pitch + x * 4);
+        for (j = g->top; j < g->bottom; j++, row = (unsigned int *)((unsigned char *)row + pitch))
+            for (bits = g->rows[j]; bits; bits &= bits - 1)
+                row[__builtin_ctzl(bits)] = lfb_fg;
         // add advances
-        x += chr[4] + 1;
-        y += chr[5];
+        x += g->advx + 1;
+        y += g->advy;
     }
-}
\ No newline at end of file
+}
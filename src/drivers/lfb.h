@@ -1,3 +1,17 @@
+/* lfb_color() background that leaves the pixels under the glyphs alone */
+#define LFB_TRANSPARENT 0xFFFFFFFF
+
 void lfb_init();
+void lfb_begin();
+void lfb_end();
+void lfb_fill(unsigned int color);
+void lfb_scroll(unsigned int n, unsigned int color);
+void lfb_size(unsigned int *cw, unsigned int *ch, unsigned int *w, unsigned int *h);
+void lfb_color(unsigned int fg, unsigned int bg);
+void lfb_simd(int on);
+void lfb_putc(int x, int y, unsigned char c);
 void lfb_print(int x, int y, char *s);
-void lfb_proprint(int x, int y, char *s);
\ No newline at end of file
+void lfb_proprint(int x, int y, char *s);
+void lfb_glyphflush();
+unsigned int lfb_cpinit();
+unsigned char *lfb_findglyph(unsigned int c);
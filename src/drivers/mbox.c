@@ -1,7 +1,8 @@
 #include "gpio.h"
+#include "mmu.h"
 
-/* mailbox message buffer */
-volatile unsigned int __attribute__((aligned(16))) mbox[36];
+/* mailbox message buffer, whole cache lines so maintenance doesn't touch neighbours */
+volatile unsigned int __attribute__((aligned(64))) mbox[48];
 
 #define VIDEOCORE_MBOX (MMIO_BASE + 0x0000B880)
 #define MBOX_READ ((volatile unsigned int *)(VIDEOCORE_MBOX + 0x0))
@@ -25,6 +26,8 @@ int mbox_call(unsigned char ch)
     {
         asm volatile("nop");
     } while (*MBOX_STATUS & MBOX_FULL);
+    /* the VideoCore reads the message from memory, not from our cache */
+    dcache_clean((void *)mbox, sizeof(mbox));
     /* write the address of our message to the mailbox with channel identifier */
     *MBOX_WRITE = r;
     /* now wait for the response */
@@ -37,8 +40,12 @@ int mbox_call(unsigned char ch)
         } while (*MBOX_STATUS & MBOX_EMPTY);
         /* is it a response to our message? */
         if (r == *MBOX_READ)
+        {
+            /* drop stale lines so we see what the VideoCore wrote */
+            dcache_invalidate((void *)mbox, sizeof(mbox));
             /* is it a valid successful response? */
             return mbox[1] == MBOX_RESPONSE;
+        }
     }
     return 0;
 }
\ No newline at end of file
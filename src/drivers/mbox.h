@@ -1,4 +1,4 @@
-extern volatile unsigned int mbox[36];
+extern volatile unsigned int mbox[48];
 
 #define MBOX_REQUEST 0
 
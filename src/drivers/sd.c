@@ -1,7 +1,11 @@
 #include "gpio.h"
-#include "uart.h"
+#include "log.h"
 #include "delays.h"
 #include "sd.h"
+#include "dma.h"
+#include "mmu.h"
+#include "mbox.h"
+#include "irq.h"
 
 #define EMMC_ARG2 ((volatile unsigned int *)(MMIO_BASE + 0x00300000))
 #define EMMC_BLKSIZECNT ((volatile unsigned int *)(MMIO_BASE + 0x00300004))
@@ -37,12 +41,17 @@
 #define CMD_READ_SINGLE 0x11220010
 #define CMD_READ_MULTI 0x12220032
 #define CMD_SET_BLOCKCNT 0x17020000
+#define CMD_SWITCH_FUNC 0x06220010
+#define CMD_WRITE_SINGLE 0x18220000
+#define CMD_WRITE_MULTI 0x19220022
+#define CMD_SET_WR_ERASE (0x17020000 | CMD_NEED_APP)
 #define CMD_APP_CMD 0x37000000
 #define CMD_SET_BUS_WIDTH (0x06020000 | CMD_NEED_APP)
 #define CMD_SEND_OP_COND (0x29020000 | CMD_NEED_APP)
 #define CMD_SEND_SCR (0x33220010 | CMD_NEED_APP)
 
 // STATUS register settings
+#define SR_DAT_LEVEL0 0x00100000
 #define SR_READ_AVAILABLE 0x00000800
 #define SR_DAT_INHIBIT 0x00000002
 #define SR_CMD_INHIBIT 0x00000001
@@ -52,8 +61,15 @@
 #define INT_DATA_TIMEOUT 0x00100000
 #define INT_CMD_TIMEOUT 0x00010000
 #define INT_READ_RDY 0x00000020
+#define INT_WRITE_RDY 0x00000010
+#define INT_DATA_DONE 0x00000002
 #define INT_CMD_DONE 0x00000001
 
+#define INT_CMD_CRC 0x00020000
+#define INT_DATA_CRC 0x00200000
+#define INT_DATA_END 0x00400000
+#define INT_CRC_ERRORS (INT_CMD_CRC | INT_DATA_CRC | INT_DATA_END)
+
 #define INT_ERROR_MASK 0x017E8000
 
 // CONTROL register settings
@@ -79,6 +95,7 @@
 #define HOST_SPEC_V1 0
 
 // SCR flags
+#define SCR_SD_SPEC 0x0000000F
 #define SCR_SD_BUS_WIDTH_4 0x00000400
 #define SCR_SUPP_SET_BLKCNT 0x02000000
 // added by my driver
@@ -89,17 +106,84 @@
 #define ACMD41_CMD_CCS 0x40000000
 #define ACMD41_ARG_HC 0x51ff8000
 
+// CMD6 SWITCH_FUNC arguments: mode, and function 1 (high speed) in group 1 leaving the others
+#define SWITCH_CHECK 0x00000000
+#define SWITCH_SET 0x80000000
+#define SWITCH_DEFAULT_SPEED 0x00FFFFF0
+#define SWITCH_HIGH_SPEED 0x00FFFFF1
+// offsets in the big endian switch status
+#define SWITCH_GRP1_SUPPORT 13
+#define SWITCH_GRP1_RESULT 16
+
+// bus modes, from the fastest
+#define SD_MODE_HS 0      // high speed, 50 MHz
+#define SD_MODE_DS 1      // default speed, 25 MHz
+#define SD_MODE_SLOW 2    // fallback after CRC errors
+#define SD_MODE_SLOWEST 3
+static unsigned int sd_modeclk[] = {50000000, 25000000, 12500000, 1000000};
+
 unsigned long sd_scr[2], sd_ocr, sd_rca, sd_err, sd_hv;
+// EMMC base clock, last error interrupts, current bus mode
+static unsigned int sd_base = 41666666, sd_ints, sd_mode = SD_MODE_SLOWEST;
+static unsigned int sd_switch[16];
+
+// polling deadlines in microseconds
+#define SD_TIMEOUT_CMD 100000   // command line or controller state
+#define SD_TIMEOUT_DATA 1000000 // data transfer, the controller's own data timeout hits first
+#define SD_TIMEOUT_BUSY 1000000 // card programming, at most 250 ms per block by the spec
+#define SD_TIMEOUT_OCR 1000000  // ACMD41 power up, 1 second by the spec
+// ACMD41 retry pause, doubled after each try up to the maximum
+#define SD_OCR_DELAY 100
+#define SD_OCR_DELAY_MAX 12800
+
+// sd_init() phases, timestamps from the system timer
+#define SD_PHASE_GPIO 0
+#define SD_PHASE_RESET 1
+#define SD_PHASE_IDLE 2
+#define SD_PHASE_OCR 3
+#define SD_PHASE_RCA 4
+#define SD_PHASE_SCR 5
+#define SD_PHASE_SPEED 6
+#define SD_PHASES 7
+static unsigned long sd_phases[SD_PHASES + 1];
+static char *sd_phasenames[SD_PHASES] = {"gpio", "reset", "idle", "ocr", "rca", "scr", "speed"};
+
+static int sd_setmode(int mode);
+static int sd_slowdown();
+
+/**
+ * Microseconds from the generic timer, for the polling deadlines
+ */
+static unsigned long sd_usec()
+{
+    unsigned long f, t;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(f));
+    asm volatile("mrs %0, cntpct_el0" : "=r"(t));
+    return t / (f / 1000000);
+}
+
+/**
+ * Spin until (*reg & mask) == value. Returns SD_OK or SD_TIMEOUT after usec
+ */
+static int sd_waitreg(volatile unsigned int *reg, unsigned int mask, unsigned int value, unsigned long usec)
+{
+    unsigned long t = sd_usec() + usec;
+    while ((*reg & mask) != value)
+        if (sd_usec() > t)
+            return (*reg & mask) == value ? SD_OK : SD_TIMEOUT;
+    return SD_OK;
+}
 
 /**
  * Wait for data or command ready
  */
 int sd_status(unsigned int mask)
 {
-    int cnt = 500000;
-    while ((*EMMC_STATUS & mask) && !(*EMMC_INTERRUPT & INT_ERROR_MASK) && cnt--)
-        wait_msec(1);
-    return (cnt <= 0 || (*EMMC_INTERRUPT & INT_ERROR_MASK)) ? SD_ERROR : SD_OK;
+    unsigned long t = sd_usec() + SD_TIMEOUT_CMD;
+    int to = 0;
+    while ((*EMMC_STATUS & mask) && !(*EMMC_INTERRUPT & INT_ERROR_MASK) && !to)
+        to = sd_usec() > t;
+    return ((*EMMC_STATUS & mask) || (*EMMC_INTERRUPT & INT_ERROR_MASK)) ? SD_ERROR : SD_OK;
 }
 
 /**
@@ -108,23 +192,21 @@ int sd_status(unsigned int mask)
 int sd_int(unsigned int mask)
 {
     unsigned int r, m = mask | INT_ERROR_MASK;
-    int cnt = 1000000;
-    while (!(*EMMC_INTERRUPT & m) && cnt--)
-        wait_msec(1);
+    unsigned long t = sd_usec() + (mask & INT_CMD_DONE ? SD_TIMEOUT_CMD : SD_TIMEOUT_DATA);
+    while (!(*EMMC_INTERRUPT & m) && sd_usec() <= t)
+        ;
     r = *EMMC_INTERRUPT;
-    if (cnt <= 0 || (r & INT_CMD_TIMEOUT) || (r & INT_DATA_TIMEOUT))
+    if (!(r & m) || (r & m & ~mask))
+        sd_ints = r;
+    if (!(r & m) || (r & INT_CMD_TIMEOUT) || (r & INT_DATA_TIMEOUT))
     {
-        uart_puts("INT TIMEOUT: ");
-        uart_hex(r);
-        uart_puts("\n");
+        log_errorx("INT TIMEOUT: ", r);
         *EMMC_INTERRUPT = r;
         return SD_TIMEOUT;
     }
     else if (r & INT_ERROR_MASK)
     {
-        uart_puts("INT ERROR: ");
-        uart_hex(r);
-        uart_puts("\n");
+        log_errorx("INT ERROR: ", r);
         *EMMC_INTERRUPT = r;
         return SD_ERROR;
     }
@@ -132,6 +214,75 @@ int sd_int(unsigned int mask)
     return 0;
 }
 
+// DMA channel for data transfers, the EMMC FIFO paces it with its DREQ
+static int sd_dma = DMA_NOCHANNEL;
+static dma_cb_t sd_dmacb;
+// DMA buffers must own their cache lines, the invalidate after a read
+// would throw away whatever else shares the first or the last one
+#define SD_DMAALIGN(b) (!((unsigned long)(b) & 63))
+
+// the asynchronous transfer on the bus, see sd_submit()
+static dma_cb_t sd_dmacbs[SD_MAXSEGS];
+// SD_IDLE, SD_ACTIVE on the bus, SD_FINISHING while one core completes it
+#define SD_IDLE 0
+#define SD_ACTIVE 1
+#define SD_FINISHING 2
+static volatile int sd_active;
+static int sd_awrite;
+static unsigned int sd_anum, sd_asegs, sd_acnt[SD_MAXSEGS];
+static unsigned char *sd_abuf[SD_MAXSEGS];
+static sd_fn sd_adone;
+static void *sd_aarg;
+
+/**
+ * Move num blocks between the data FIFO and buffer with DMA. The read or
+ * write command must already be sent and buffer SD_DMAALIGN. Returns SD_OK
+ * or an error.
+ */
+static int sd_dmaxfer(unsigned char *buffer, unsigned int num, int write)
+{
+    int r;
+    if (write)
+    {
+        // the engine reads memory, not our cache
+        dcache_clean(buffer, num * 512);
+        sd_dmacb.ti = DMA_TI_DEST_DREQ | DMA_TI_PERMAP(DMA_DREQ_EMMC) | DMA_TI_SRC_INC | DMA_TI_WAIT_RESP | DMA_TI_INTEN;
+        sd_dmacb.source_ad = dma_busaddr(buffer);
+        sd_dmacb.dest_ad = dma_ioaddr(EMMC_DATA);
+    }
+    else
+    {
+        // no dirty line may get evicted over the incoming data later
+        dcache_flush(buffer, num * 512);
+        sd_dmacb.ti = DMA_TI_SRC_DREQ | DMA_TI_PERMAP(DMA_DREQ_EMMC) | DMA_TI_DEST_INC | DMA_TI_WAIT_RESP | DMA_TI_INTEN;
+        sd_dmacb.source_ad = dma_ioaddr(EMMC_DATA);
+        sd_dmacb.dest_ad = dma_busaddr(buffer);
+    }
+    sd_dmacb.txfr_len = num * 512;
+    sd_dmacb.stride = 0;
+    sd_dmacb.nextconbk = 0;
+    dma_start(sd_dma, &sd_dmacb, 0, 0);
+    // sleeps until the completion interrupt
+    r = dma_wait(sd_dma);
+    // the data is in memory, drop whatever the CPU speculatively cached
+    if (!write)
+        dcache_invalidate(buffer, num * 512);
+    if (r)
+    {
+        log_error("ERROR: EMMC DMA transfer failed\n");
+        return SD_ERROR;
+    }
+    return sd_int(INT_DATA_DONE);
+}
+
+/**
+ * Wait until the card releases DAT0 after programming
+ */
+static int sd_busy()
+{
+    return sd_waitreg(EMMC_STATUS, SR_DAT_LEVEL0, SR_DAT_LEVEL0, SD_TIMEOUT_BUSY);
+}
+
 /**
  * Send a command
  */
@@ -144,7 +295,7 @@ int sd_cmd(unsigned int code, unsigned int arg)
         r = sd_cmd(CMD_APP_CMD | (sd_rca ? CMD_RSPNS_48 : 0), sd_rca);
         if (sd_rca && !r)
         {
-            uart_puts("ERROR: failed to send SD APP command\n");
+            log_error("ERROR: failed to send SD APP command\n");
             sd_err = SD_ERROR;
             return 0;
         }
@@ -152,25 +303,18 @@ int sd_cmd(unsigned int code, unsigned int arg)
     }
     if (sd_status(SR_CMD_INHIBIT))
     {
-        uart_puts("ERROR: EMMC busy\n");
+        log_error("ERROR: EMMC busy\n");
         sd_err = SD_TIMEOUT;
         return 0;
     }
-    uart_puts("EMMC: Sending command ");
-    uart_hex(code);
-    uart_puts(" arg ");
-    uart_hex(arg);
-    uart_puts("\n");
+    log_trace("EMMC: Sending command, arg", code, arg);
     *EMMC_INTERRUPT = *EMMC_INTERRUPT;
     *EMMC_ARG1 = arg;
     *EMMC_CMDTM = code;
-    if (code == CMD_SEND_OP_COND)
-        wait_msec(1000);
-    else if (code == CMD_SEND_IF_COND || code == CMD_APP_CMD)
-        wait_msec(100);
+    // a card that doesn't answer raises CMD_TIMEOUT, no need to sleep
     if ((r = sd_int(INT_CMD_DONE)))
     {
-        uart_puts("ERROR: failed to send EMMC command\n");
+        log_error("ERROR: failed to send EMMC command\n");
         sd_err = r;
         return 0;
     }
@@ -201,19 +345,125 @@ int sd_cmd(unsigned int code, unsigned int arg)
 }
 
 /**
- * read a block from sd card and return the number of bytes read
- * returns 0 on error.
+ * EMMC interrupt, finishes the asynchronous transfer
  */
-int sd_readblock(unsigned int lba, unsigned char *buffer, unsigned int num)
+static void sd_irq()
+{
+    unsigned int r = *EMMC_INTERRUPT, i;
+    int status = SD_OK, expect = SD_ACTIVE;
+    if (sd_active != SD_ACTIVE || !(r & (INT_DATA_DONE | INT_ERROR_MASK)))
+        return;
+    // the interrupt on core 0 and sd_poll() on another core may both get here, one finishes
+    if (!__atomic_compare_exchange_n(&sd_active, &expect, SD_FINISHING, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    *EMMC_INT_EN = 0;
+    if (r & INT_ERROR_MASK)
+    {
+        // the engine would wait for a DREQ that never comes
+        log_errorx("INT ERROR: ", r);
+        sd_ints = r;
+        status = (r & (INT_CMD_TIMEOUT | INT_DATA_TIMEOUT)) ? SD_TIMEOUT : SD_ERROR;
+        dma_abort(sd_dma);
+    }
+    else if (dma_wait(sd_dma))
+    {
+        // the FIFO is drained, this only waits for the engine's last writes
+        status = SD_ERROR;
+    }
+    *EMMC_INTERRUPT = r;
+    if (!sd_awrite)
+        for (i = 0; i < sd_asegs; i++)
+            dcache_invalidate(sd_abuf[i], sd_acnt[i] * 512);
+    if (sd_anum > 1 && !(sd_scr[0] & SCR_SUPP_SET_BLKCNT))
+        sd_cmd(CMD_STOP_TRANS, 0);
+    sd_err = status;
+    __atomic_store_n(&sd_active, SD_IDLE, __ATOMIC_RELEASE);
+    // may start the next transfer right away
+    sd_adone(status, sd_aarg);
+}
+
+/**
+ * Check for the end of an asynchronous transfer, works with interrupts masked
+ */
+void sd_poll()
+{
+    unsigned long flags = irq_save();
+    sd_irq();
+    irq_restore(flags);
+}
+
+/**
+ * Start a multi-block transfer scattered to (or gathered from) several
+ * cache line aligned buffers with one command and a DMA control block chain, and
+ * return without waiting. done is called from the EMMC interrupt. Returns
+ * SD_OK if the transfer is on the bus, otherwise the caller has to fall
+ * back to sd_readblock()/sd_writeblock().
+ */
+int sd_submit(unsigned int lba, unsigned int segs, unsigned char **buffers, unsigned int *counts, int write, sd_fn done, void *arg)
+{
+    unsigned int i, num = 0;
+    dma_cb_t *cb;
+
+    if (sd_active || sd_dma < 0 || !(sd_scr[0] & SCR_SUPP_CCS) || !segs || segs > SD_MAXSEGS)
+        return SD_ERROR;
+    for (i = 0; i < segs; i++)
+    {
+        if (!SD_DMAALIGN(buffers[i]))
+            return SD_ERROR;
+        cb = &sd_dmacbs[i];
+        if (write)
+        {
+            dcache_clean(buffers[i], counts[i] * 512);
+            cb->ti = DMA_TI_DEST_DREQ | DMA_TI_PERMAP(DMA_DREQ_EMMC) | DMA_TI_SRC_INC | DMA_TI_WAIT_RESP;
+            cb->source_ad = dma_busaddr(buffers[i]);
+            cb->dest_ad = dma_ioaddr(EMMC_DATA);
+        }
+        else
+        {
+            dcache_flush(buffers[i], counts[i] * 512);
+            cb->ti = DMA_TI_SRC_DREQ | DMA_TI_PERMAP(DMA_DREQ_EMMC) | DMA_TI_DEST_INC | DMA_TI_WAIT_RESP;
+            cb->source_ad = dma_ioaddr(EMMC_DATA);
+            cb->dest_ad = dma_busaddr(buffers[i]);
+        }
+        cb->txfr_len = counts[i] * 512;
+        cb->stride = 0;
+        cb->nextconbk = i + 1 < segs ? dma_busaddr(&sd_dmacbs[i + 1]) : 0;
+        sd_abuf[i] = buffers[i];
+        sd_acnt[i] = counts[i];
+        num += counts[i];
+    }
+    sd_ints = 0;
+    if (sd_status(SR_DAT_INHIBIT | SR_CMD_INHIBIT) || (write && sd_busy()))
+        return SD_TIMEOUT;
+    if (num > 1 && (write || (sd_scr[0] & SCR_SUPP_SET_BLKCNT)))
+    {
+        sd_cmd((sd_scr[0] & SCR_SUPP_SET_BLKCNT) ? CMD_SET_BLOCKCNT : CMD_SET_WR_ERASE, num);
+        if (sd_err)
+            return sd_err;
+    }
+    *EMMC_BLKSIZECNT = (num << 16) | 512;
+    sd_cmd(write ? (num == 1 ? CMD_WRITE_SINGLE : CMD_WRITE_MULTI) : (num == 1 ? CMD_READ_SINGLE : CMD_READ_MULTI), lba);
+    if (sd_err)
+        return sd_err;
+    sd_awrite = write;
+    sd_anum = num;
+    sd_asegs = segs;
+    sd_adone = done;
+    sd_aarg = arg;
+    sd_active = SD_ACTIVE;
+    dma_start(sd_dma, &sd_dmacbs[0], 0, 0);
+    // level triggered, fires right away if the transfer is already done
+    *EMMC_INT_EN = INT_DATA_DONE | INT_ERROR_MASK;
+    return SD_OK;
+}
+
+/**
+ * read blocks from sd card in the current bus mode
+ */
+static int sd_readblocks(unsigned int lba, unsigned char *buffer, unsigned int num)
 {
     int r, c = 0, d;
-    if (num < 1)
-        num = 1;
-    uart_puts("sd_readblock lba ");
-    uart_hex(lba);
-    uart_puts(" num ");
-    uart_hex(num);
-    uart_puts("\n");
+    sd_ints = 0;
     if (sd_status(SR_DAT_INHIBIT))
     {
         sd_err = SD_TIMEOUT;
@@ -232,6 +482,16 @@ int sd_readblock(unsigned int lba, unsigned char *buffer, unsigned int num)
         sd_cmd(num == 1 ? CMD_READ_SINGLE : CMD_READ_MULTI, lba);
         if (sd_err)
             return 0;
+        // cache line aligned buffers go through DMA, the CPU copies the rest
+        if (sd_dma >= 0 && SD_DMAALIGN(buffer))
+        {
+            if ((r = sd_dmaxfer(buffer, num, 0)))
+            {
+                sd_err = r;
+                return 0;
+            }
+            c = num;
+        }
     }
     else
     {
@@ -247,7 +507,7 @@ int sd_readblock(unsigned int lba, unsigned char *buffer, unsigned int num)
         }
         if ((r = sd_int(INT_READ_RDY)))
         {
-            uart_puts("\rERROR: Timeout waiting for ready to read\n");
+            log_error("\rERROR: Timeout waiting for ready to read\n");
             sd_err = r;
             return 0;
         }
@@ -262,95 +522,301 @@ int sd_readblock(unsigned int lba, unsigned char *buffer, unsigned int num)
 }
 
 /**
- * set SD clock to frequency in Hz
+ * read a block from sd card and return the number of bytes read
+ * returns 0 on error.
  */
-int sd_clk(unsigned int f)
+int sd_readblock(unsigned int lba, unsigned char *buffer, unsigned int num)
 {
-    unsigned int d, c = 41666666 / f, x, s = 32, h = 0;
-    int cnt = 100000;
-    while ((*EMMC_STATUS & (SR_CMD_INHIBIT | SR_DAT_INHIBIT)) && cnt--)
-        wait_msec(1);
-    if (cnt <= 0)
+    int r;
+    if (num < 1)
+        num = 1;
+    log_trace("sd_readblock lba, num", lba, num);
+    // the bus is ours once the asynchronous transfer is done
+    while (sd_active)
+        sd_poll();
+    // retry in a slower bus mode as long as the errors are signal integrity ones
+    while (!(r = sd_readblocks(lba, buffer, num)) && (sd_ints & INT_CRC_ERRORS) && sd_slowdown())
+        ;
+    return r;
+}
+
+/**
+ * write blocks to sd card in the current bus mode
+ */
+static int sd_writeblocks(unsigned int lba, unsigned char *buffer, unsigned int num)
+{
+    int r, c = 0, d;
+    sd_ints = 0;
+    if (sd_status(SR_DAT_INHIBIT | SR_CMD_INHIBIT) || sd_busy())
     {
-        uart_puts("ERROR: timeout waiting for inhibit flag\n");
-        return SD_ERROR;
+        sd_err = SD_TIMEOUT;
+        return 0;
     }
-
-    *EMMC_CONTROL1 &= ~C1_CLK_EN;
-    wait_msec(10);
-    x = c - 1;
-    if (!x)
-        s = 0;
-    else
+    unsigned int *buf = (unsigned int *)buffer;
+    if (sd_scr[0] & SCR_SUPP_CCS)
     {
-        if (!(x & 0xffff0000u))
+        if (num > 1)
         {
-            x <<= 16;
-            s -= 16;
+            // tell the card how much is coming: an exact count if it knows
+            // CMD23, otherwise a pre-erase hint so it can prepare the blocks
+            sd_cmd((sd_scr[0] & SCR_SUPP_SET_BLKCNT) ? CMD_SET_BLOCKCNT : CMD_SET_WR_ERASE, num);
+            if (sd_err)
+                return 0;
         }
-        if (!(x & 0xff000000u))
+        *EMMC_BLKSIZECNT = (num << 16) | 512;
+        sd_cmd(num == 1 ? CMD_WRITE_SINGLE : CMD_WRITE_MULTI, lba);
+        if (sd_err)
+            return 0;
+        if (sd_dma >= 0 && SD_DMAALIGN(buffer))
         {
-            x <<= 8;
-            s -= 8;
+            if ((r = sd_dmaxfer(buffer, num, 1)))
+            {
+                sd_err = r;
+                return 0;
+            }
+            c = num;
         }
-        if (!(x & 0xf0000000u))
+    }
+    else
+    {
+        *EMMC_BLKSIZECNT = (1 << 16) | 512;
+    }
+    while (c < num)
+    {
+        if (!(sd_scr[0] & SCR_SUPP_CCS))
         {
-            x <<= 4;
-            s -= 4;
+            sd_cmd(CMD_WRITE_SINGLE, (lba + c) * 512);
+            if (sd_err)
+                return 0;
         }
-        if (!(x & 0xc0000000u))
+        if ((r = sd_int(INT_WRITE_RDY)))
         {
-            x <<= 2;
-            s -= 2;
+            log_error("\rERROR: Timeout waiting for ready to write\n");
+            sd_err = r;
+            return 0;
         }
-        if (!(x & 0x80000000u))
+        for (d = 0; d < 128; d++)
+            *EMMC_DATA = buf[d];
+        c++;
+        buf += 128;
+        // single block commands finish one by one
+        if (!(sd_scr[0] & SCR_SUPP_CCS) || c == num)
         {
-            x <<= 1;
-            s -= 1;
+            if ((r = sd_int(INT_DATA_DONE)) || (r = sd_busy()))
+            {
+                sd_err = r;
+                return 0;
+            }
         }
-        if (s > 0)
-            s--;
-        if (s > 7)
-            s = 7;
     }
-    if (sd_hv > HOST_SPEC_V2)
-        d = c;
+    if (num > 1 && !(sd_scr[0] & SCR_SUPP_SET_BLKCNT) && (sd_scr[0] & SCR_SUPP_CCS))
+        sd_cmd(CMD_STOP_TRANS, 0);
+    // card programs the data while it holds DAT0 low
+    if (!sd_err && (r = sd_busy()))
+        sd_err = r;
+    return sd_err != SD_OK || c != num ? 0 : num * 512;
+}
+
+/**
+ * write a block to sd card and return the number of bytes written.
+ * Contiguous sectors go out as one multi-block write, returns 0 on error.
+ */
+int sd_writeblock(unsigned int lba, unsigned char *buffer, unsigned int num)
+{
+    int r;
+    if (num < 1)
+        num = 1;
+    log_trace("sd_writeblock lba, num", lba, num);
+    while (sd_active)
+        sd_poll();
+    while (!(r = sd_writeblocks(lba, buffer, num)) && (sd_ints & INT_CRC_ERRORS) && sd_slowdown())
+        ;
+    return r;
+}
+
+/**
+ * set SD clock to frequency in Hz, never faster than asked for
+ */
+int sd_clk(unsigned int f)
+{
+    unsigned int d, h = 0;
+    if (sd_waitreg(EMMC_STATUS, SR_CMD_INHIBIT | SR_DAT_INHIBIT, 0, SD_TIMEOUT_CMD))
+    {
+        log_error("ERROR: timeout waiting for inhibit flag\n");
+        return SD_ERROR;
+    }
+
+    // the card clock stays off while the divider changes
+    *EMMC_CONTROL1 &= ~C1_CLK_EN;
+    // SD clock is base / (2 * d), or the base clock itself when d is 0
+    if (f >= sd_base)
+        d = 0;
+    else if (sd_hv > HOST_SPEC_V2)
+    {
+        // 10 bit divided clock mode
+        d = (sd_base + 2 * f - 1) / (2 * f);
+        if (d > 0x3FF)
+            d = 0x3FF;
+    }
     else
-        d = (1 << s);
-    if (d <= 2)
     {
-        d = 2;
-        s = 0;
+        // 8 bit, power of two divisors only
+        for (d = 1; d < 0x80 && sd_base / (2 * d) > f; d <<= 1)
+            ;
     }
-    uart_puts("sd_clk divisor ");
-    uart_hex(d);
-    uart_puts(", shift ");
-    uart_hex(s);
-    uart_puts("\n");
+    log_trace("sd_clk divisor, Hz", d, d ? sd_base / (2 * d) : sd_base);
     if (sd_hv > HOST_SPEC_V2)
         h = (d & 0x300) >> 2;
     d = (((d & 0x0ff) << 8) | h);
     *EMMC_CONTROL1 = (*EMMC_CONTROL1 & 0xffff003f) | d;
-    wait_msec(10);
-    *EMMC_CONTROL1 |= C1_CLK_EN;
-    wait_msec(10);
-    cnt = 10000;
-    while (!(*EMMC_CONTROL1 & C1_CLK_STABLE) && cnt--)
-        wait_msec(10);
-    if (cnt <= 0)
+    if (sd_waitreg(EMMC_CONTROL1, C1_CLK_STABLE, C1_CLK_STABLE, SD_TIMEOUT_CMD))
     {
-        uart_puts("ERROR: failed to get stable clock\n");
+        log_error("ERROR: failed to get stable clock\n");
         return SD_ERROR;
     }
+    *EMMC_CONTROL1 |= C1_CLK_EN;
+    return SD_OK;
+}
+
+/**
+ * Ask the firmware for the EMMC base clock, keep the usual 41.67 MHz otherwise
+ */
+static void sd_getbase()
+{
+    mbox[0] = 8 * 4;
+    mbox[1] = MBOX_REQUEST;
+    mbox[2] = 0x30002; // get clock rate
+    mbox[3] = 8;
+    mbox[4] = 4;
+    mbox[5] = 1; // EMMC clock
+    mbox[6] = 0;
+    mbox[7] = MBOX_TAG_LAST;
+    if (mbox_call(MBOX_CH_PROP) && mbox[6])
+        sd_base = mbox[6];
+}
+
+/**
+ * Send CMD6 SWITCH_FUNC and read the 64 byte switch status into sd_switch
+ */
+static int sd_switchfunc(unsigned int arg)
+{
+    int r;
+    if (sd_status(SR_DAT_INHIBIT))
+        return SD_TIMEOUT;
+    *EMMC_BLKSIZECNT = (1 << 16) | 64;
+    sd_cmd(CMD_SWITCH_FUNC, arg);
+    if (sd_err)
+        return sd_err;
+    if ((r = sd_int(INT_READ_RDY)))
+        return r;
+    for (r = 0; r < 16; r++)
+    {
+        if (sd_waitreg(EMMC_STATUS, SR_READ_AVAILABLE, SR_READ_AVAILABLE, SD_TIMEOUT_DATA))
+            return SD_TIMEOUT;
+        sd_switch[r] = *EMMC_DATA;
+    }
     return SD_OK;
 }
 
+/**
+ * Move the card to the fastest bus speed both of us support: high speed
+ * (50 MHz) if CMD6 says the card can switch, default speed (25 MHz) otherwise
+ */
+static int sd_setspeed()
+{
+    unsigned char *st = (unsigned char *)sd_switch;
+    sd_mode = SD_MODE_DS;
+    // CMD6 is there since SD 1.10
+    if ((sd_scr[0] & SCR_SD_SPEC) >= 1 && !sd_switchfunc(SWITCH_CHECK | SWITCH_HIGH_SPEED) &&
+        (st[SWITCH_GRP1_SUPPORT] & (1 << 1)))
+    {
+        // switch status is big endian: group 1 support in bytes 12-13, result in byte 16
+        if (!sd_switchfunc(SWITCH_SET | SWITCH_HIGH_SPEED) && (st[SWITCH_GRP1_RESULT] & 0xF) == 1)
+            sd_mode = SD_MODE_HS;
+    }
+    return sd_setmode(sd_mode);
+}
+
+/**
+ * Set host side timing and clock for a bus mode
+ */
+static int sd_setmode(int mode)
+{
+    sd_mode = mode;
+    log_trace("EMMC: bus mode, Hz", mode, sd_modeclk[mode]);
+    if (mode == SD_MODE_HS)
+        *EMMC_CONTROL0 |= C0_HCTL_HS_EN;
+    else
+        *EMMC_CONTROL0 &= ~C0_HCTL_HS_EN;
+    return sd_clk(sd_modeclk[mode]);
+}
+
+/**
+ * Switch the bus to high speed if the card takes it (high != 0) or back to
+ * default speed. Returns the bus clock in Hz actually set, 0 on error
+ */
+unsigned int sd_busspeed(int high)
+{
+    while (sd_active)
+        sd_poll();
+    if (high)
+    {
+        if (sd_setspeed())
+            return 0;
+    }
+    else
+    {
+        // the card has to leave high speed timing too, not just the host
+        if (sd_mode == SD_MODE_HS && sd_switchfunc(SWITCH_SET | SWITCH_DEFAULT_SPEED))
+            return 0;
+        if (sd_setmode(SD_MODE_DS))
+            return 0;
+    }
+    return sd_modeclk[sd_mode];
+}
+
+/**
+ * After CRC errors drop to the next slower bus mode. Returns 0 if we are
+ * already as slow as we go.
+ */
+static int sd_slowdown()
+{
+    if (sd_mode >= SD_MODE_SLOWEST)
+        return 0;
+    // reset the command and data lines, and get the card out of a transfer
+    *EMMC_CONTROL1 |= C1_SRST_CMD | C1_SRST_DATA;
+    sd_waitreg(EMMC_CONTROL1, C1_SRST_CMD | C1_SRST_DATA, 0, SD_TIMEOUT_CMD);
+    *EMMC_INTERRUPT = *EMMC_INTERRUPT;
+    sd_cmd(CMD_STOP_TRANS, 0);
+    log_error("EMMC: CRC errors, slowing down the bus\n");
+    return !sd_setmode(sd_mode + 1);
+}
+
+/**
+ * Print when each sd_init() phase ended, in microseconds since power on and
+ * since sd_init() started
+ */
+static void sd_inittimes()
+{
+    int i;
+    for (i = 0; i < SD_PHASES; i++)
+    {
+        log_info("EMMC: ");
+        log_info(sd_phasenames[i]);
+        log_infox(" done at ", sd_phases[i]);
+        log_infox("  since init ", sd_phases[i] - sd_phases[SD_PHASES]);
+    }
+}
+
 /**
  * initialize EMMC to read SDHC card
  */
 int sd_init()
 {
-    long r, cnt, ccs = 0;
+    long r, ccs = 0;
+    unsigned long t;
+    unsigned int d;
+    sd_phases[SD_PHASES] = get_system_timer();
     // GPIO_CD
     r = *GPFSEL4;
     r &= ~(7 << (7 * 3));
@@ -388,27 +854,27 @@ int sd_init()
     *GPPUDCLK1 = 0;
 
     sd_hv = (*EMMC_SLOTISR_VER & HOST_SPEC_NUM) >> HOST_SPEC_NUM_SHIFT;
-    uart_puts("EMMC: GPIO set up\n");
+    sd_getbase();
+    log_trace("EMMC: GPIO set up", 0, 0);
+    sd_phases[SD_PHASE_GPIO] = get_system_timer();
     // Reset the card.
     *EMMC_CONTROL0 = 0;
     *EMMC_CONTROL1 |= C1_SRST_HC;
-    cnt = 10000;
-    do
-    {
-        wait_msec(10);
-    } while ((*EMMC_CONTROL1 & C1_SRST_HC) && cnt--);
-    if (cnt <= 0)
+    if (sd_waitreg(EMMC_CONTROL1, C1_SRST_HC, 0, SD_TIMEOUT_CMD))
     {
-        uart_puts("ERROR: failed to reset EMMC\n");
+        log_error("ERROR: failed to reset EMMC\n");
         return SD_ERROR;
     }
-    uart_puts("EMMC: reset OK\n");
+    log_trace("EMMC: reset OK", 0, 0);
     *EMMC_CONTROL1 |= C1_CLK_INTLEN | C1_TOUNIT_MAX;
-    wait_msec(10);
     // Set clock to setup frequency.
     if ((r = sd_clk(100000)))
         return r;
-    *EMMC_INT_EN = 0xffffffff;
+    // the card wants 74 clocks before the first command
+    wait_msec(1000);
+    sd_phases[SD_PHASE_RESET] = get_system_timer();
+    // status bits only, sd_submit() turns on the interrupt it waits for
+    *EMMC_INT_EN = 0;
     *EMMC_INT_MASK = 0xffffffff;
     sd_scr[0] = sd_scr[1] = sd_rca = sd_err = 0;
     sd_cmd(CMD_GO_IDLE, 0);
@@ -418,30 +884,25 @@ int sd_init()
     sd_cmd(CMD_SEND_IF_COND, 0x000001AA);
     if (sd_err)
         return sd_err;
-    cnt = 6;
-    r = 0;
-    while (!(r & ACMD41_CMD_COMPLETE) && cnt--)
+    sd_phases[SD_PHASE_IDLE] = get_system_timer();
+    // ask until the card finished powering up, most need a few milliseconds
+    t = sd_usec() + SD_TIMEOUT_OCR;
+    for (d = SD_OCR_DELAY;; d = d < SD_OCR_DELAY_MAX ? d << 1 : d)
     {
-        wait_cycles(400);
         r = sd_cmd(CMD_SEND_OP_COND, ACMD41_ARG_HC);
-        uart_puts("EMMC: CMD_SEND_OP_COND returned ");
-        if (r & ACMD41_CMD_COMPLETE)
-            uart_puts("COMPLETE ");
-        if (r & ACMD41_VOLTAGE)
-            uart_puts("VOLTAGE ");
-        if (r & ACMD41_CMD_CCS)
-            uart_puts("CCS ");
-        uart_hex(r >> 32);
-        uart_hex(r);
-        uart_puts("\n");
+        log_trace("EMMC: CMD_SEND_OP_COND returned", r >> 32, r);
         if (sd_err != SD_TIMEOUT && sd_err != SD_OK)
         {
-            uart_puts("ERROR: EMMC ACMD41 returned error\n");
+            log_error("ERROR: EMMC ACMD41 returned error\n");
             return sd_err;
         }
+        if ((r & ACMD41_CMD_COMPLETE) || sd_usec() > t)
+            break;
+        wait_msec(d);
     }
-    if (!(r & ACMD41_CMD_COMPLETE) || !cnt)
+    if (!(r & ACMD41_CMD_COMPLETE))
         return SD_TIMEOUT;
+    sd_phases[SD_PHASE_OCR] = get_system_timer();
     if (!(r & ACMD41_VOLTAGE))
         return SD_ERROR;
     if (r & ACMD41_CMD_CCS)
@@ -450,10 +911,7 @@ int sd_init()
     sd_cmd(CMD_ALL_SEND_CID, 0);
 
     sd_rca = sd_cmd(CMD_SEND_REL_ADDR, 0);
-    uart_puts("EMMC: CMD_SEND_REL_ADDR returned ");
-    uart_hex(sd_rca >> 32);
-    uart_hex(sd_rca);
-    uart_puts("\n");
+    log_trace("EMMC: CMD_SEND_REL_ADDR returned", sd_rca >> 32, sd_rca);
     if (sd_err)
         return sd_err;
 
@@ -463,6 +921,7 @@ int sd_init()
     sd_cmd(CMD_CARD_SELECT, sd_rca);
     if (sd_err)
         return sd_err;
+    sd_phases[SD_PHASE_RCA] = get_system_timer();
 
     if (sd_status(SR_DAT_INHIBIT))
         return SD_TIMEOUT;
@@ -474,17 +933,12 @@ int sd_init()
     if (sd_int(INT_READ_RDY))
         return SD_TIMEOUT;
 
-    r = 0;
-    cnt = 100000;
-    while (r < 2 && cnt)
+    for (r = 0; r < 2; r++)
     {
-        if (*EMMC_STATUS & SR_READ_AVAILABLE)
-            sd_scr[r++] = *EMMC_DATA;
-        else
-            wait_msec(1);
+        if (sd_waitreg(EMMC_STATUS, SR_READ_AVAILABLE, SR_READ_AVAILABLE, SD_TIMEOUT_DATA))
+            return SD_TIMEOUT;
+        sd_scr[r] = *EMMC_DATA;
     }
-    if (r != 2)
-        return SD_TIMEOUT;
     if (sd_scr[0] & SCR_SD_BUS_WIDTH_4)
     {
         sd_cmd(CMD_SET_BUS_WIDTH, sd_rca | 2);
@@ -492,14 +946,22 @@ int sd_init()
             return sd_err;
         *EMMC_CONTROL0 |= C0_HCTL_DWITDH;
     }
+    sd_phases[SD_PHASE_SCR] = get_system_timer();
+    // leave the 1 MHz identification clock for high or default speed
+    if ((r = sd_setspeed()))
+        return r;
+    sd_phases[SD_PHASE_SPEED] = get_system_timer();
     // add software flag
-    uart_puts("EMMC: supports ");
+    log_info("EMMC: supports ");
     if (sd_scr[0] & SCR_SUPP_SET_BLKCNT)
-        uart_puts("SET_BLKCNT ");
+        log_info("SET_BLKCNT ");
     if (ccs)
-        uart_puts("CCS ");
-    uart_puts("\n");
+        log_info("CCS ");
+    log_info(sd_mode == SD_MODE_HS ? "HS\n" : "\n");
     sd_scr[0] &= ~SCR_SUPP_CCS;
     sd_scr[0] |= ccs;
+    if (sd_dma < 0 && (sd_dma = dma_alloc()) >= 0)
+        irq_register(IRQ_EMMC, sd_irq);
+    sd_inittimes();
     return SD_OK;
 }
\ No newline at end of file
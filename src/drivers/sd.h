@@ -2,5 +2,14 @@
 #define SD_TIMEOUT -1
 #define SD_ERROR -2
 
+/* most buffers one asynchronous transfer can scatter to or gather from */
+#define SD_MAXSEGS 16
+
+typedef void (*sd_fn)(int status, void *arg);
+
 int sd_init();
-int sd_readblock(unsigned int lba, unsigned char *buffer, unsigned int num);
\ No newline at end of file
+int sd_readblock(unsigned int lba, unsigned char *buffer, unsigned int num);
+int sd_writeblock(unsigned int lba, unsigned char *buffer, unsigned int num);
+int sd_submit(unsigned int lba, unsigned int segs, unsigned char **buffers, unsigned int *counts, int write, sd_fn done, void *arg);
+void sd_poll();
+unsigned int sd_busspeed(int high);
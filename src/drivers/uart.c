@@ -1,53 +1,123 @@
-#include "gpio.h"
+#include "uart.h"
+#include "lock.h"
+#include "irq.h"
+#include "uart_hw.h"
 
-/* Auxilary mini UART registers */
-#define AUX_ENABLE ((volatile unsigned int *)(MMIO_BASE + 0x00215004))
-#define AUX_MU_IO ((volatile unsigned int *)(MMIO_BASE + 0x00215040))
-#define AUX_MU_IER ((volatile unsigned int *)(MMIO_BASE + 0x00215044))
-#define AUX_MU_IIR ((volatile unsigned int *)(MMIO_BASE + 0x00215048))
-#define AUX_MU_LCR ((volatile unsigned int *)(MMIO_BASE + 0x0021504C))
-#define AUX_MU_MCR ((volatile unsigned int *)(MMIO_BASE + 0x00215050))
-#define AUX_MU_LSR ((volatile unsigned int *)(MMIO_BASE + 0x00215054))
-#define AUX_MU_MSR ((volatile unsigned int *)(MMIO_BASE + 0x00215058))
-#define AUX_MU_SCRATCH ((volatile unsigned int *)(MMIO_BASE + 0x0021505C))
-#define AUX_MU_CNTL ((volatile unsigned int *)(MMIO_BASE + 0x00215060))
-#define AUX_MU_STAT ((volatile unsigned int *)(MMIO_BASE + 0x00215064))
-#define AUX_MU_BAUD ((volatile unsigned int *)(MMIO_BASE + 0x00215068))
+/* ring buffers, sizes must be powers of two. Each ring has a single
+   consumer and a single producer side, multiple cores queueing output are
+   serialised by uart_txlock, whoever moves bytes to the hardware by
+   uart_pumplock. */
+#define UART_TXBUF 4096
+#define UART_RXBUF 256
+static volatile unsigned char uart_txbuf[UART_TXBUF];
+static volatile unsigned char uart_rxbuf[UART_RXBUF];
+static volatile unsigned int uart_txhead, uart_txtail;
+static volatile unsigned int uart_rxhead, uart_rxtail;
+static spinlock_t uart_txlock, uart_rxlock, uart_pumplock;
+// is the TX interrupt on, only changed with uart_pumplock held
+static volatile unsigned int uart_txint;
+// gets a copy of the output, may be called from interrupt handlers
+static uart_hook_fn uart_hook;
 
 /**
- * Set baud rate and characteristics (115200 8N1) and map to GPIO
+ * Move queued bytes into the transmitter FIFO. Called from the interrupt and
+ * by producers. Only one core pumps at a time, the others just leave. The
+ * pump runs with interrupts masked: the TX interrupt is level triggered, and
+ * taken on the core holding uart_pumplock it would fail the trylock forever.
  */
-void uart_init()
+static void uart_txpump()
 {
-    register unsigned int r;
+    unsigned long flags;
+    unsigned int on;
+    do
+    {
+        flags = irq_save();
+        if (!spin_trylock(&uart_pumplock))
+        {
+            irq_restore(flags);
+            return;
+        }
+        while (uart_txtail != __atomic_load_n(&uart_txhead, __ATOMIC_ACQUIRE) && uart_hwtxready())
+        {
+            uart_hwputc(uart_txbuf[uart_txtail % UART_TXBUF]);
+            __atomic_store_n(&uart_txtail, uart_txtail + 1, __ATOMIC_RELEASE);
+        }
+        /* only ask for the TX interrupt while there's something left to send */
+        on = uart_txtail != uart_txhead;
+        if (on != uart_txint)
+            uart_hwtxint(uart_txint = on);
+        spin_unlock(&uart_pumplock);
+        irq_restore(flags);
+        /* a producer may have queued while we were turning the TX interrupt off */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    } while (!uart_txint && uart_txtail != __atomic_load_n(&uart_txhead, __ATOMIC_ACQUIRE));
+}
 
-    /* initialize UART */
-    *AUX_ENABLE |= 1; // enable UART1, AUX mini uart
-    *AUX_MU_CNTL = 0;
-    *AUX_MU_LCR = 3; // 8 bits
-    *AUX_MU_MCR = 0;
-    *AUX_MU_IER = 0;
-    *AUX_MU_IIR = 0xc6; // disable interrupts
-    *AUX_MU_BAUD = 434; // 115200 baud
-    /* map UART1 to GPIO pins */
-    r = *GPFSEL1;
-    r &= ~((7 << 12) | (7 << 15)); // gpio14, gpio15
-    r |= (2 << 12) | (2 << 15);    // alt5
-    *GPFSEL1 = r;
-    *GPPUD = 0; // enable pins 14 and 15
-    r = 150;
-    while (r--)
+/**
+ * Move received bytes from the FIFO into the ring, drop them if it's full
+ */
+static void uart_rxpump()
+{
+    unsigned char c;
+    while (uart_hwrxready())
     {
-        asm volatile("nop");
+        c = uart_hwgetc();
+        if (uart_rxhead - uart_rxtail < UART_RXBUF)
+        {
+            uart_rxbuf[uart_rxhead % UART_RXBUF] = c;
+            __atomic_store_n(&uart_rxhead, uart_rxhead + 1, __ATOMIC_RELEASE);
+        }
     }
-    *GPPUDCLK0 = (1 << 14) | (1 << 15);
-    r = 150;
-    while (r--)
+}
+
+/**
+ * UART interrupt handler
+ */
+void uart_irq()
+{
+    if (!uart_hwpending())
+        return;
+    spin_lock(&uart_rxlock);
+    uart_rxpump();
+    spin_unlock(&uart_rxlock);
+    uart_txpump();
+}
+
+/**
+ * Queue one byte, with uart_txlock held. If the ring is full and we may
+ * block, drain it ourselves (works with interrupts masked too).
+ */
+static int uart_txput(unsigned char c, int block)
+{
+    while (uart_txhead - __atomic_load_n(&uart_txtail, __ATOMIC_ACQUIRE) >= UART_TXBUF)
     {
-        asm volatile("nop");
+        if (!block)
+            return 0;
+        uart_txpump();
     }
-    *GPPUDCLK0 = 0;   // flush GPIO setup
-    *AUX_MU_CNTL = 3; // enable Tx, Rx
+    uart_txbuf[uart_txhead % UART_TXBUF] = c;
+    __atomic_store_n(&uart_txhead, uart_txhead + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * Set up the UART backend chosen at build time and hook its interrupt
+ */
+void uart_init()
+{
+    /* from now on the rings are drained and filled from the interrupt */
+    uart_txhead = uart_txtail = uart_rxhead = uart_rxtail = 0;
+    uart_txint = 0;
+    irq_register(uart_hwinit(), uart_irq);
+}
+
+/**
+ * Pass a copy of everything sent from now on to fn (for example con_write),
+ * 0 stops it. fn must be safe in interrupt handlers.
+ */
+void uart_mirror(uart_hook_fn fn)
+{
+    uart_hook = fn;
 }
 
 /**
@@ -55,13 +125,66 @@ void uart_init()
  */
 void uart_send(unsigned int c)
 {
-    /* wait until we can send */
-    do
+    char ch = c;
+    unsigned long flags = irq_save();
+    spin_lock(&uart_txlock);
+    uart_txput(c, 1);
+    spin_unlock(&uart_txlock);
+    irq_restore(flags);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uart_txpump();
+    if (uart_hook)
+        uart_hook(&ch, 1);
+}
+
+/**
+ * Queue up to len bytes without blocking, returns the number queued
+ */
+unsigned int uart_write(const void *buf, unsigned int len)
+{
+    const unsigned char *s = buf;
+    unsigned int n = 0;
+    unsigned long flags = irq_save();
+    spin_lock(&uart_txlock);
+    while (n < len && uart_txput(s[n], 0))
+        n++;
+    spin_unlock(&uart_txlock);
+    irq_restore(flags);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uart_txpump();
+    if (uart_hook)
+        uart_hook(buf, n);
+    return n;
+}
+
+/**
+ * Wait until everything queued left the ring. Usable with interrupts masked.
+ */
+void uart_flush()
+{
+    while (__atomic_load_n(&uart_txtail, __ATOMIC_ACQUIRE) != uart_txhead)
+        uart_txpump();
+}
+
+/**
+ * Read up to len received bytes without blocking, returns the number read
+ */
+unsigned int uart_read(void *buf, unsigned int len)
+{
+    unsigned char *d = buf;
+    unsigned int n = 0;
+    unsigned long flags = irq_save();
+    spin_lock(&uart_rxlock);
+    // in case interrupts aren't enabled yet
+    uart_rxpump();
+    while (n < len && uart_rxtail != uart_rxhead)
     {
-        asm volatile("nop");
-    } while (!(*AUX_MU_LSR & 0x20));
-    /* write the character to the buffer */
-    *AUX_MU_IO = c;
+        d[n++] = uart_rxbuf[uart_rxtail % UART_RXBUF];
+        __atomic_store_n(&uart_rxtail, uart_rxtail + 1, __ATOMIC_RELEASE);
+    }
+    spin_unlock(&uart_rxlock);
+    irq_restore(flags);
+    return n;
 }
 
 /**
@@ -71,12 +194,8 @@ char uart_getc()
 {
     char r;
     /* wait until something is in the buffer */
-    do
-    {
-        asm volatile("nop");
-    } while (!(*AUX_MU_LSR & 0x01));
-    /* read it and return */
-    r = (char)(*AUX_MU_IO);
+    while (!uart_read(&r, 1))
+        asm volatile("yield");
     /* convert carriage return to newline */
     return r == '\r' ? '\n' : r;
 }
@@ -86,13 +205,23 @@ char uart_getc()
  */
 void uart_puts(char *s)
 {
-    while (*s)
+    char *p = s;
+    unsigned long flags = irq_save();
+    /* keep the whole string together when several cores print */
+    spin_lock(&uart_txlock);
+    while (*p)
     {
         /* convert newline to carriage return + newline */
-        if (*s == '\n')
-            uart_send('\r');
-        uart_send(*s++);
+        if (*p == '\n')
+            uart_txput('\r', 1);
+        uart_txput(*p++, 1);
     }
+    spin_unlock(&uart_txlock);
+    irq_restore(flags);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uart_txpump();
+    if (uart_hook)
+        uart_hook(s, p - s);
 }
 
 /**
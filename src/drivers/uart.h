@@ -1,6 +1,14 @@
+/* gets everything printed, see uart_mirror() */
+typedef void (*uart_hook_fn)(const char *s, unsigned int len);
+
 void uart_init();
+void uart_irq();
 void uart_send(unsigned int c);
 char uart_getc();
 void uart_puts(char *s);
 void uart_hex(unsigned int d);
-void uart_dump(void *ptr);
\ No newline at end of file
+void uart_dump(void *ptr);
+unsigned int uart_write(const void *buf, unsigned int len);
+unsigned int uart_read(void *buf, unsigned int len);
+void uart_flush();
+void uart_mirror(uart_hook_fn fn);
@@ -0,0 +1,8 @@
+/* UART hardware backends, one of them is built (make UART=mini or UART=pl011) */
+unsigned int uart_hwinit();
+int uart_hwpending();
+int uart_hwtxready();
+void uart_hwputc(unsigned char c);
+int uart_hwrxready();
+unsigned char uart_hwgetc();
+void uart_hwtxint(int on);
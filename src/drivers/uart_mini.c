@@ -0,0 +1,120 @@
+#ifndef UART_PL011
+#include "gpio.h"
+#include "irq.h"
+
+/* Auxilary mini UART registers */
+#define AUX_IRQ ((volatile unsigned int *)(MMIO_BASE + 0x00215000))
+#define AUX_ENABLE ((volatile unsigned int *)(MMIO_BASE + 0x00215004))
+#define AUX_MU_IO ((volatile unsigned int *)(MMIO_BASE + 0x00215040))
+#define AUX_MU_IER ((volatile unsigned int *)(MMIO_BASE + 0x00215044))
+#define AUX_MU_IIR ((volatile unsigned int *)(MMIO_BASE + 0x00215048))
+#define AUX_MU_LCR ((volatile unsigned int *)(MMIO_BASE + 0x0021504C))
+#define AUX_MU_MCR ((volatile unsigned int *)(MMIO_BASE + 0x00215050))
+#define AUX_MU_LSR ((volatile unsigned int *)(MMIO_BASE + 0x00215054))
+#define AUX_MU_MSR ((volatile unsigned int *)(MMIO_BASE + 0x00215058))
+#define AUX_MU_SCRATCH ((volatile unsigned int *)(MMIO_BASE + 0x0021505C))
+#define AUX_MU_CNTL ((volatile unsigned int *)(MMIO_BASE + 0x00215060))
+#define AUX_MU_STAT ((volatile unsigned int *)(MMIO_BASE + 0x00215064))
+#define AUX_MU_BAUD ((volatile unsigned int *)(MMIO_BASE + 0x00215068))
+
+// interrupt enable bits (bits 3:2 must be set too, or no RX interrupts arrive)
+#define AUX_MU_IER_RX 0x0D
+#define AUX_MU_IER_TX 0x02
+// line status bits
+#define AUX_MU_LSR_RXREADY 0x01
+#define AUX_MU_LSR_TXEMPTY 0x20
+
+// the mini UART is clocked from the VPU core clock. enable_uart=1 in
+// config.txt pins that to 250 MHz, otherwise it scales with the load and
+// the rate drifts (the old fixed divisor of 434 assumed 400 MHz)
+#define AUX_CLOCK 250000000
+#ifndef UART_BAUD
+#define UART_BAUD 115200
+#endif
+
+/**
+ * Set baud rate and characteristics (8N1) and map to GPIO. Returns the IRQ
+ */
+unsigned int uart_hwinit()
+{
+    register unsigned int r;
+
+    /* initialize UART */
+    *AUX_ENABLE |= 1; // enable UART1, AUX mini uart
+    *AUX_MU_CNTL = 0;
+    *AUX_MU_LCR = 3; // 8 bits
+    *AUX_MU_MCR = 0;
+    *AUX_MU_IER = 0;
+    *AUX_MU_IIR = 0xc6;                           // disable interrupts
+    *AUX_MU_BAUD = AUX_CLOCK / (8 * UART_BAUD) - 1; // 270 for 115200 baud
+    /* map UART1 to GPIO pins */
+    r = *GPFSEL1;
+    r &= ~((7 << 12) | (7 << 15)); // gpio14, gpio15
+    r |= (2 << 12) | (2 << 15);    // alt5
+    *GPFSEL1 = r;
+    *GPPUD = 0; // enable pins 14 and 15
+    r = 150;
+    while (r--)
+    {
+        asm volatile("nop");
+    }
+    *GPPUDCLK0 = (1 << 14) | (1 << 15);
+    r = 150;
+    while (r--)
+    {
+        asm volatile("nop");
+    }
+    *GPPUDCLK0 = 0;   // flush GPIO setup
+    *AUX_MU_CNTL = 3; // enable Tx, Rx
+    *AUX_MU_IER = AUX_MU_IER_RX;
+    return IRQ_AUX;
+}
+
+/**
+ * Is the interrupt ours? The AUX interrupt is shared with the SPI masters
+ */
+int uart_hwpending()
+{
+    return *AUX_IRQ & 1;
+}
+
+/**
+ * Can the transmitter FIFO take another byte?
+ */
+int uart_hwtxready()
+{
+    return *AUX_MU_LSR & AUX_MU_LSR_TXEMPTY;
+}
+
+/**
+ * Put a byte in the transmitter FIFO
+ */
+void uart_hwputc(unsigned char c)
+{
+    *AUX_MU_IO = c;
+}
+
+/**
+ * Is there a byte in the receiver FIFO?
+ */
+int uart_hwrxready()
+{
+    return *AUX_MU_LSR & AUX_MU_LSR_RXREADY;
+}
+
+/**
+ * Take a byte from the receiver FIFO
+ */
+unsigned char uart_hwgetc()
+{
+    return (unsigned char)(*AUX_MU_IO);
+}
+
+/**
+ * Turn the transmitter empty interrupt on or off
+ */
+void uart_hwtxint(int on)
+{
+    *AUX_MU_IER = AUX_MU_IER_RX | (on ? AUX_MU_IER_TX : 0);
+}
+#endif
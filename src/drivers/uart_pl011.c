@@ -0,0 +1,142 @@
+#ifdef UART_PL011
+#include "gpio.h"
+#include "mbox.h"
+#include "irq.h"
+
+/* PL011 UART registers */
+#define UART0_DR ((volatile unsigned int *)(MMIO_BASE + 0x00201000))
+#define UART0_FR ((volatile unsigned int *)(MMIO_BASE + 0x00201018))
+#define UART0_IBRD ((volatile unsigned int *)(MMIO_BASE + 0x00201024))
+#define UART0_FBRD ((volatile unsigned int *)(MMIO_BASE + 0x00201028))
+#define UART0_LCRH ((volatile unsigned int *)(MMIO_BASE + 0x0020102C))
+#define UART0_CR ((volatile unsigned int *)(MMIO_BASE + 0x00201030))
+#define UART0_IFLS ((volatile unsigned int *)(MMIO_BASE + 0x00201034))
+#define UART0_IMSC ((volatile unsigned int *)(MMIO_BASE + 0x00201038))
+#define UART0_RIS ((volatile unsigned int *)(MMIO_BASE + 0x0020103C))
+#define UART0_MIS ((volatile unsigned int *)(MMIO_BASE + 0x00201040))
+#define UART0_ICR ((volatile unsigned int *)(MMIO_BASE + 0x00201044))
+
+// flag register
+#define FR_RXFE 0x10 // receive FIFO empty
+#define FR_TXFF 0x20 // transmit FIFO full
+// line control: 8 bits, FIFOs on
+#define LCRH_8N1_FIFO ((3 << 5) | (1 << 4))
+// control: enable UART, TX and RX
+#define CR_ENABLE ((1 << 9) | (1 << 8) | (1 << 0))
+// FIFO watermarks: TX when 1/8 full (2 bytes left to send), RX when 1/2 full
+#define IFLS_TX_1_8 (0 << 0)
+#define IFLS_RX_1_2 (2 << 3)
+// interrupt bits: receive, transmit, receive timeout (FIFO below watermark but idle)
+#define INT_RX (1 << 4)
+#define INT_TX (1 << 5)
+#define INT_RT (1 << 6)
+
+// fixed UART reference clock we ask the firmware for
+#define UART0_CLOCK 48000000
+#ifndef UART_BAUD
+#define UART_BAUD 921600
+#endif
+
+/**
+ * Set the UART clock and baud rate, 8N1 with FIFOs, and map to GPIO. Returns the IRQ
+ */
+unsigned int uart_hwinit()
+{
+    register unsigned int r;
+
+    /* initialize UART */
+    *UART0_CR = 0; // turn off UART0
+
+    /* set up clock for consistent divisor values */
+    mbox[0] = 9 * 4;
+    mbox[1] = MBOX_REQUEST;
+    mbox[2] = MBOX_TAG_SETCLKRATE; // set clock rate
+    mbox[3] = 12;
+    mbox[4] = 8;
+    mbox[5] = 2;           // UART clock
+    mbox[6] = UART0_CLOCK; // 48 MHz
+    mbox[7] = 0;           // clear turbo
+    mbox[8] = MBOX_TAG_LAST;
+    mbox_call(MBOX_CH_PROP);
+
+    /* map UART0 to GPIO pins */
+    r = *GPFSEL1;
+    r &= ~((7 << 12) | (7 << 15)); // gpio14, gpio15
+    r |= (4 << 12) | (4 << 15);    // alt0
+    *GPFSEL1 = r;
+    *GPPUD = 0; // enable pins 14 and 15
+    r = 150;
+    while (r--)
+    {
+        asm volatile("nop");
+    }
+    *GPPUDCLK0 = (1 << 14) | (1 << 15);
+    r = 150;
+    while (r--)
+    {
+        asm volatile("nop");
+    }
+    *GPPUDCLK0 = 0; // flush GPIO setup
+
+    /* divisor in 1/64ths: clock / (16 * baud) */
+    r = (UART0_CLOCK * 4 + UART_BAUD / 2) / UART_BAUD;
+    *UART0_ICR = 0x7FF; // clear interrupts
+    *UART0_IBRD = r >> 6;
+    *UART0_FBRD = r & 63;
+    *UART0_LCRH = LCRH_8N1_FIFO;
+    *UART0_IFLS = IFLS_TX_1_8 | IFLS_RX_1_2;
+    *UART0_IMSC = INT_RX | INT_RT;
+    *UART0_CR = CR_ENABLE;
+    return IRQ_UART;
+}
+
+/**
+ * Is the interrupt ours? Acknowledges it too
+ */
+int uart_hwpending()
+{
+    unsigned int r = *UART0_MIS;
+    *UART0_ICR = r;
+    return r != 0;
+}
+
+/**
+ * Can the transmitter FIFO take another byte?
+ */
+int uart_hwtxready()
+{
+    return !(*UART0_FR & FR_TXFF);
+}
+
+/**
+ * Put a byte in the transmitter FIFO
+ */
+void uart_hwputc(unsigned char c)
+{
+    *UART0_DR = c;
+}
+
+/**
+ * Is there a byte in the receiver FIFO?
+ */
+int uart_hwrxready()
+{
+    return !(*UART0_FR & FR_RXFE);
+}
+
+/**
+ * Take a byte from the receiver FIFO
+ */
+unsigned char uart_hwgetc()
+{
+    return (unsigned char)(*UART0_DR);
+}
+
+/**
+ * Turn the transmit FIFO watermark interrupt on or off
+ */
+void uart_hwtxint(int on)
+{
+    *UART0_IMSC = INT_RX | INT_RT | (on ? INT_TX : 0);
+}
+#endif
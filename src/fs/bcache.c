@@ -0,0 +1,248 @@
+#include "sd.h"
+#include "lock.h"
+#include "log.h"
+#include "bcache.h"
+
+// hash buckets, power of two
+#define BCACHE_HASH 128
+// runs of missing blocks this long are streamed straight into the caller's buffer
+#define BCACHE_BYPASS 32
+
+typedef struct bcache_s
+{
+    unsigned char data[512];
+    unsigned int lba;
+    unsigned int valid;
+    struct bcache_s *hnext;     // hash chain
+    struct bcache_s *prev, *next; // LRU list, most recently used at the head
+} __attribute__((aligned(64))) bcache_t;
+
+static bcache_t bcache_blocks[BCACHE_BLOCKS];
+static bcache_t *bcache_hash[BCACHE_HASH];
+static bcache_t *bcache_head, *bcache_tail;
+static spinlock_t bcache_lock;
+static int bcache_inited = 0;
+static unsigned int bcache_hits, bcache_misses, bcache_ra;
+// read-ahead state: where the last fetch ended, and the current window
+static unsigned int bcache_next = -1, bcache_window = 0;
+// miss runs and read-ahead land here first, DMA friendly
+static unsigned char __attribute__((aligned(64))) bcache_stage[BCACHE_READAHEAD * 512];
+
+/**
+ * Put every block on the LRU list, invalid and unhashed
+ */
+static void bcache_init()
+{
+    int i;
+    for (i = 0; i < BCACHE_BLOCKS; i++)
+    {
+        bcache_blocks[i].valid = 0;
+        bcache_blocks[i].hnext = 0;
+        bcache_blocks[i].prev = i ? &bcache_blocks[i - 1] : 0;
+        bcache_blocks[i].next = i < BCACHE_BLOCKS - 1 ? &bcache_blocks[i + 1] : 0;
+    }
+    for (i = 0; i < BCACHE_HASH; i++)
+        bcache_hash[i] = 0;
+    bcache_head = &bcache_blocks[0];
+    bcache_tail = &bcache_blocks[BCACHE_BLOCKS - 1];
+    bcache_inited = 1;
+}
+
+/**
+ * Move a block to the head of the LRU list
+ */
+static void bcache_touch(bcache_t *b)
+{
+    if (b == bcache_head)
+        return;
+    b->prev->next = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    else
+        bcache_tail = b->prev;
+    b->prev = 0;
+    b->next = bcache_head;
+    bcache_head->prev = b;
+    bcache_head = b;
+}
+
+/**
+ * Look up a block by LBA
+ */
+static bcache_t *bcache_find(unsigned int lba)
+{
+    bcache_t *b;
+    for (b = bcache_hash[lba % BCACHE_HASH]; b && b->lba != lba; b = b->hnext)
+        ;
+    return b;
+}
+
+/**
+ * Remove a block from its hash chain
+ */
+static void bcache_unhash(bcache_t *b)
+{
+    bcache_t **p;
+    for (p = &bcache_hash[b->lba % BCACHE_HASH]; *p; p = &(*p)->hnext)
+        if (*p == b)
+        {
+            *p = b->hnext;
+            break;
+        }
+    b->valid = 0;
+}
+
+/**
+ * Store a block's data, recycling the least recently used one if needed
+ */
+static void bcache_insert(unsigned int lba, unsigned char *data)
+{
+    bcache_t *b = bcache_find(lba);
+    unsigned int i;
+    if (!b)
+    {
+        b = bcache_tail;
+        if (b->valid)
+            bcache_unhash(b);
+        b->lba = lba;
+        b->hnext = bcache_hash[lba % BCACHE_HASH];
+        bcache_hash[lba % BCACHE_HASH] = b;
+        b->valid = 1;
+    }
+    for (i = 0; i < 512; i++)
+        b->data[i] = data[i];
+    bcache_touch(b);
+}
+
+/**
+ * Copy a block from the cache
+ */
+static void bcache_copy(unsigned char *dst, bcache_t *b)
+{
+    unsigned int i;
+    for (i = 0; i < 512; i++)
+        dst[i] = b->data[i];
+}
+
+/**
+ * Read a run of missing blocks. Short runs go through the staging buffer
+ * into the cache, with read-ahead when the access pattern is sequential.
+ */
+static int bcache_fill(unsigned int lba, unsigned char *buffer, unsigned int num)
+{
+    unsigned int i, j, n;
+
+    if (num >= BCACHE_BYPASS)
+    {
+        // streaming, don't wipe the cache with data nobody reads twice
+        bcache_next = lba + num;
+        return sd_readblock(lba, buffer, num);
+    }
+    // sequential access grows the window, anything else resets it
+    if (lba == bcache_next)
+        bcache_window = bcache_window ? bcache_window * 2 : 4;
+    else
+        bcache_window = 0;
+    n = num + bcache_window;
+    if (n > BCACHE_READAHEAD)
+        n = BCACHE_READAHEAD;
+    if (!sd_readblock(lba, bcache_stage, n))
+    {
+        // the read-ahead may run past the end of the card, try without it
+        bcache_window = 0;
+        if (n == num || !sd_readblock(lba, bcache_stage, n = num))
+            return 0;
+    }
+    bcache_ra += n - num;
+    bcache_next = lba + n;
+    // read-ahead blocks go in first, so the requested ones end up most recent
+    for (i = n; i > 0; i--)
+        bcache_insert(lba + i - 1, bcache_stage + (i - 1) * 512);
+    for (i = 0; i < num; i++)
+        for (j = 0; j < 512; j++)
+            buffer[i * 512 + j] = bcache_stage[i * 512 + j];
+    return num * 512;
+}
+
+/**
+ * Read num blocks through the cache. Returns the number of bytes read, 0 on error
+ */
+int bcache_read(unsigned int lba, unsigned char *buffer, unsigned int num)
+{
+    unsigned int c = 0, n;
+    bcache_t *b;
+    int r = 1;
+
+    spin_lock(&bcache_lock);
+    if (!bcache_inited)
+        bcache_init();
+    while (c < num && r)
+    {
+        if ((b = bcache_find(lba + c)))
+        {
+            bcache_hits++;
+            bcache_copy(buffer + c * 512, b);
+            bcache_touch(b);
+            c++;
+            continue;
+        }
+        // collect the run of missing blocks and fetch it in one go. Long
+        // runs bypass the cache whole, only staged ones must fit the buffer
+        for (n = 1; c + n < num && !bcache_find(lba + c + n); n++)
+            ;
+        if (n < BCACHE_BYPASS && n > BCACHE_READAHEAD)
+            n = BCACHE_READAHEAD;
+        bcache_misses += n;
+        r = bcache_fill(lba + c, buffer + c * 512, n);
+        c += n;
+    }
+    spin_unlock(&bcache_lock);
+    log_trace("bcache_read lba, num", lba, num);
+    return r ? num * 512 : 0;
+}
+
+/**
+ * Write num blocks to the card, updating the cached copies (write-through)
+ */
+int bcache_write(unsigned int lba, unsigned char *buffer, unsigned int num)
+{
+    unsigned int i;
+    int r;
+
+    spin_lock(&bcache_lock);
+    if (!bcache_inited)
+        bcache_init();
+    r = sd_writeblock(lba, buffer, num);
+    for (i = 0; i < num; i++)
+        if (bcache_find(lba + i))
+        {
+            if (r)
+                bcache_insert(lba + i, buffer + i * 512);
+            else
+                bcache_unhash(bcache_find(lba + i));
+        }
+    spin_unlock(&bcache_lock);
+    return r;
+}
+
+/**
+ * Forget everything, for example after the card was changed
+ */
+void bcache_invalidate()
+{
+    spin_lock(&bcache_lock);
+    bcache_init();
+    bcache_next = -1;
+    bcache_window = 0;
+    spin_unlock(&bcache_lock);
+}
+
+/**
+ * Return the hit, miss and read-ahead block counters
+ */
+void bcache_stats(unsigned int *hits, unsigned int *misses, unsigned int *readahead)
+{
+    *hits = bcache_hits;
+    *misses = bcache_misses;
+    *readahead = bcache_ra;
+}
@@ -0,0 +1,11 @@
+/* number of cached 512 byte blocks, make BCACHE_BLOCKS=n to change */
+#ifndef BCACHE_BLOCKS
+#define BCACHE_BLOCKS 256
+#endif
+/* longest sequential read-ahead, in blocks */
+#define BCACHE_READAHEAD 64
+
+int bcache_read(unsigned int lba, unsigned char *buffer, unsigned int num);
+int bcache_write(unsigned int lba, unsigned char *buffer, unsigned int num);
+void bcache_invalidate();
+void bcache_stats(unsigned int *hits, unsigned int *misses, unsigned int *readahead);
@@ -1,5 +1,8 @@
 #include "sd.h"
 #include "uart.h"
+#include "log.h"
+#include "bcache.h"
+#include "fat.h"
 #include <stdint.h>
 #include <stddef.h>
 
@@ -58,7 +61,612 @@ typedef struct
     unsigned int size;
 } __attribute__((packed)) fatdir_t;
 
+// longest single read in sectors when a file's clusters are contiguous,
+// make FAT_MAX_XFER=n to change (the EMMC block counter stops at 65535)
+#ifndef FAT_MAX_XFER
+#define FAT_MAX_XFER 1024
+#endif
+
 static unsigned char fat_buf[1024]; // 1024 for safety, 512 is minimum
+// the volume's boot record, kept so that fat_buf is free for other sectors
+static unsigned char fat_vbr[512];
+// resident FAT sectors, make FAT_WINDOW=n to change
+#ifndef FAT_WINDOW
+#define FAT_WINDOW 8
+#endif
+
+typedef struct
+{
+    unsigned char data[512];
+    unsigned int lba;
+    unsigned int valid;
+    unsigned int dirty; // changed, only written to the first FAT so far
+    unsigned int stamp; // last use, the smallest one is replaced
+} __attribute__((aligned(64))) fatwin_t;
+
+static fatwin_t fat_win[FAT_WINDOW];
+static unsigned int fat_winclock;
+// FAT sectors changed since the last fat_sync(), relative to the first FAT
+static unsigned int fat_dmin = -1, fat_dmax;
+
+// free cluster bitmap, one bit per cluster, set if in use. Filled lazily a
+// FAT sector at a time, clusters past its end are checked in the FAT itself
+#ifndef FAT_BITMAP
+#define FAT_BITMAP 131072
+#endif
+static unsigned char fat_bits[FAT_BITMAP];
+// FAT sectors already accounted for in fat_bits (at least 128 clusters each)
+static unsigned char fat_scanned[FAT_BITMAP / 16];
+// where to look for free clusters next, free cluster count (-1 unknown)
+static unsigned int fat_hint, fat_freecnt;
+static int fat_infodirty;
+// FAT32 FSInfo sector
+static unsigned char fat_fsinfo[512];
+// sectors copied between the FATs by fat_sync()
+#define FAT_MIRRORBUF 16
+static unsigned char __attribute__((aligned(64))) fat_mirror[FAT_MIRRORBUF * 512];
+
+// directories with a lookup index, entries and hash buckets per index
+#ifndef FAT_DIRCACHE
+#define FAT_DIRCACHE 4
+#endif
+// names per index, a file with a long name takes two
+#ifndef FAT_DIRENTS
+#define FAT_DIRENTS 8192
+#endif
+#if FAT_DIRENTS > 65535
+#error "FAT_DIRENTS must fit the 16 bit bucket links"
+#endif
+#define FAT_DIRHASH 2048
+
+// an indexed name. Two independent 32 bit hashes stand in for the name
+// itself, a false match would need both of them to collide
+typedef struct
+{
+    unsigned int h1, h2;
+    unsigned int cluster;
+    unsigned int size;
+    unsigned int pos;    // entry number in the directory
+    unsigned short next; // next in bucket, index + 1
+    unsigned char attr;
+} fatent_t;
+
+typedef struct
+{
+    unsigned int cluster; // directory's first cluster, 0 for the FAT16 root
+    unsigned int valid;
+    unsigned int stamp;
+    unsigned int count;
+    unsigned int full; // didn't fit, misses must scan the directory
+    unsigned short hash[FAT_DIRHASH]; // first in bucket, index + 1
+    fatent_t ent[FAT_DIRENTS];
+} fatidx_t;
+
+static fatidx_t fat_idx[FAT_DIRCACHE];
+static unsigned int fat_idxclock;
+// directory sectors are scanned here
+static unsigned char __attribute__((aligned(64))) fat_dirbuf[512];
+// chain of the directory being scanned
+static fat_file_t fat_dirfile;
+// directory part of a path being created
+static char fat_path[256];
+
+// file descriptors handed out by fat_open()
+static fat_file_t fat_files[FAT_MAXFILES];
+static int fat_used[FAT_MAXFILES];
+
+// free memory after the kernel, where fat_readfile() puts files
+extern unsigned char _end;
+
+static unsigned int fat_locate(fat_file_t *file, unsigned int idx, unsigned int *run);
+static unsigned char *fat_direntry(unsigned int dir, unsigned int pos, unsigned int *lba);
+
+/**
+ * Return the FAT16 root directory's LBA and its length in sectors
+ */
+static unsigned int fat_rootsec(unsigned int *num)
+{
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    unsigned int root_sec;
+    root_sec = ((bpb->spf16 ? bpb->spf16 : bpb->spf32) * bpb->nf) + bpb->rsc;
+    *num = ((bpb->nr0 + (bpb->nr1 << 8)) * sizeof(fatdir_t) + 511) / 512;
+    // add partition LBA
+    return root_sec + partitionlba;
+}
+
+/**
+ * Return the root directory's first cluster, 0 for the fixed FAT16 root
+ */
+static unsigned int fat_root()
+{
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    // on FAT32 the root is an ordinary cluster chain
+    return bpb->spf16 > 0 ? 0 : bpb->rc;
+}
+
+/**
+ * Return the LBA of the first data sector (cluster 2)
+ */
+static unsigned int fat_datasec()
+{
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    unsigned int data_sec;
+    data_sec = ((bpb->spf16 ? bpb->spf16 : bpb->spf32) * bpb->nf) + bpb->rsc;
+    if (bpb->spf16 > 0)
+    {
+        // adjust for FAT16
+        data_sec += ((bpb->nr0 + (bpb->nr1 << 8)) * sizeof(fatdir_t) + 511) >> 9;
+    }
+    // add partition LBA
+    return data_sec + partitionlba;
+}
+
+/**
+ * Return the highest valid cluster number
+ */
+static unsigned int fat_maxclust()
+{
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    unsigned int ts = bpb->ts16 ? bpb->ts16 : bpb->ts32;
+    return (ts - (fat_datasec() - partitionlba)) / bpb->spc + 1;
+}
+
+/**
+ * Return a resident copy of a FAT sector, loading it over the least recently used one
+ */
+static fatwin_t *fat_getwin(unsigned int lba)
+{
+    fatwin_t *w = &fat_win[0];
+    int i;
+    for (i = 0; i < FAT_WINDOW; i++)
+    {
+        if (fat_win[i].valid && fat_win[i].lba == lba)
+        {
+            fat_win[i].stamp = ++fat_winclock;
+            return &fat_win[i];
+        }
+        if (!fat_win[i].valid || fat_win[i].stamp < w->stamp)
+            w = &fat_win[i];
+    }
+    // changes only go to the first FAT here, fat_sync() mirrors them
+    if (w->valid && w->dirty && !bcache_write(w->lba, w->data, 1))
+        return 0;
+    w->valid = w->dirty = 0;
+    if (!bcache_read(lba, w->data, 1))
+        return 0;
+    w->lba = lba;
+    w->valid = 1;
+    w->stamp = ++fat_winclock;
+    return w;
+}
+
+// fat_get() couldn't read the FAT sector, never taken for a free cluster
+#define FAT_EIO 0xFFFFFFFF
+
+/**
+ * Return the raw FAT entry of a cluster, 0 means free, FAT_EIO a read error
+ */
+static unsigned int fat_get(unsigned int cluster)
+{
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    unsigned int offs = cluster * (bpb->spf16 > 0 ? 2 : 4);
+    fatwin_t *w;
+    // only the FAT sector holding this entry is needed
+    if (!(w = fat_getwin(partitionlba + bpb->rsc + offs / 512)))
+        return FAT_EIO;
+    offs %= 512;
+    if (bpb->spf16 > 0)
+        return *((unsigned short *)(w->data + offs));
+    // (Yep, MS is full of lies. FAT32 is actually FAT28 only, no mistake, the upper 4 bits must be zero)
+    return *((unsigned int *)(w->data + offs)) & 0x0FFFFFFF;
+}
+
+/**
+ * Change the FAT entry of a cluster, 0 frees it, -1 marks end of chain
+ */
+static int fat_set(unsigned int cluster, unsigned int value)
+{
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    unsigned int offs = cluster * (bpb->spf16 > 0 ? 2 : 4), *p;
+    fatwin_t *w;
+    if (!(w = fat_getwin(partitionlba + bpb->rsc + offs / 512)))
+        return 0;
+    offs %= 512;
+    if (bpb->spf16 > 0)
+        *((unsigned short *)(w->data + offs)) = value;
+    else
+    {
+        // keep the reserved upper 4 bits
+        p = (unsigned int *)(w->data + offs);
+        *p = (*p & 0xF0000000) | (value & 0x0FFFFFFF);
+    }
+    w->dirty = 1;
+    if (w->lba - partitionlba - bpb->rsc < fat_dmin)
+        fat_dmin = w->lba - partitionlba - bpb->rsc;
+    if (w->lba - partitionlba - bpb->rsc > fat_dmax)
+        fat_dmax = w->lba - partitionlba - bpb->rsc;
+    // keep the free cluster bitmap up to date
+    if (cluster < FAT_BITMAP * 8)
+    {
+        if (value)
+            fat_bits[cluster / 8] |= 1 << (cluster % 8);
+        else
+            fat_bits[cluster / 8] &= ~(1 << (cluster % 8));
+    }
+    return 1;
+}
+
+/**
+ * Return the cluster following the given one in its chain, 0 at the end of chain
+ */
+static unsigned int fat_next(unsigned int cluster)
+{
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    unsigned int next = fat_get(cluster);
+    return next > 1 && next < (bpb->spf16 > 0 ? 0xFFF8 : 0x0FFFFFF8) ? next : 0;
+}
+
+/**
+ * Tell if a cluster is in use. The bitmap is filled in a FAT sector at a time.
+ * Returns -1 if the FAT couldn't be read, so nothing in use gets allocated
+ */
+static int fat_inuse(unsigned int cluster)
+{
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    unsigned int eps = bpb->spf16 > 0 ? 256 : 128, s = cluster / eps, c, v, i;
+    fatwin_t *w;
+    if (cluster >= FAT_BITMAP * 8)
+        return (v = fat_get(cluster)) == FAT_EIO ? -1 : v != 0;
+    if (!(fat_scanned[s / 8] & (1 << (s % 8))))
+    {
+        if (!(w = fat_getwin(partitionlba + bpb->rsc + s)))
+            return -1;
+        for (i = 0, c = s * eps; i < eps && c < FAT_BITMAP * 8; i++, c++)
+        {
+            v = bpb->spf16 > 0 ? ((unsigned short *)w->data)[i] : ((unsigned int *)w->data)[i] & 0x0FFFFFFF;
+            if (v)
+                fat_bits[c / 8] |= 1 << (c % 8);
+            else
+                fat_bits[c / 8] &= ~(1 << (c % 8));
+        }
+        fat_scanned[s / 8] |= 1 << (s % 8);
+    }
+    return (fat_bits[cluster / 8] >> (cluster % 8)) & 1;
+}
+
+/**
+ * Return the LBA of sector sec of a directory, 0 past its end
+ */
+static unsigned int fat_dirlba(unsigned int cluster, unsigned int sec)
+{
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    unsigned int n, lba, run;
+    if (!cluster)
+    {
+        lba = fat_rootsec(&n);
+        return sec < n ? lba + sec : 0;
+    }
+    // directories have no size, follow the chain until it ends
+    if (fat_dirfile.cluster != cluster)
+    {
+        fat_dirfile.cluster = fat_dirfile.next = cluster;
+        fat_dirfile.size = -1;
+        fat_dirfile.mapped = fat_dirfile.count = fat_dirfile.pos = 0;
+    }
+    if (!(n = fat_locate(&fat_dirfile, sec / bpb->spc, &run)))
+        return 0;
+    return (n - 2) * bpb->spc + fat_datasec() + sec % bpb->spc;
+}
+
+/**
+ * Read sector sec of a directory, returns 0 past its end
+ */
+static int fat_dirread(unsigned int cluster, unsigned int sec, unsigned char *buffer)
+{
+    unsigned int lba = fat_dirlba(cluster, sec);
+    return lba && bcache_read(lba, buffer, 1);
+}
+
+// VFAT stores 13 UCS-2 characters per long name entry at these offsets
+static const unsigned char fat_lfnoffs[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+/**
+ * Fold a code point for case insensitive names, only ASCII like Windows does
+ */
+static unsigned int fat_fold(unsigned int c)
+{
+    return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+/**
+ * Hash one code point into both name hashes, case insensitive
+ */
+static void fat_hash(unsigned int c, unsigned int *h1, unsigned int *h2)
+{
+    c = fat_fold(c);
+    *h1 = (*h1 ^ c) * 16777619;
+    *h2 = *h2 * 33 + c;
+}
+
+/**
+ * Decode one UTF-8 code point of a path and move past it
+ */
+static unsigned int fat_utf8(unsigned char **path)
+{
+    unsigned char *p = *path;
+    unsigned int c = *p++;
+    if (c >= 0xE0 && p[0] && p[1])
+    {
+        c = ((c & 0x0F) << 12) | ((p[0] & 0x3F) << 6) | (p[1] & 0x3F);
+        p += 2;
+    }
+    else if (c >= 0xC0 && p[0])
+    {
+        c = ((c & 0x1F) << 6) | (p[0] & 0x3F);
+        p++;
+    }
+    *path = p;
+    return c;
+}
+
+/**
+ * Hash a path component (UTF-8) up to the next '/', and move past it
+ */
+static void fat_hashpath(char **path, unsigned int *h1, unsigned int *h2)
+{
+    unsigned char *p = (unsigned char *)*path;
+    *h1 = 2166136261;
+    *h2 = 5381;
+    while (*p && *p != '/')
+        fat_hash(fat_utf8(&p), h1, h2);
+    *path = (char *)p;
+}
+
+/**
+ * Compare a path component (UTF-8) up to the next '/' with a UCS-2 name of
+ * at most n characters, which ends early at a 0 or 0xFFFF. Case insensitive
+ */
+static int fat_namecmp(char *path, unsigned short *name, unsigned int n)
+{
+    unsigned char *p = (unsigned char *)path;
+    unsigned int i;
+    for (i = 0; i < n && name[i] && name[i] != 0xFFFF; i++)
+        if (!*p || *p == '/' || fat_fold(fat_utf8(&p)) != fat_fold(name[i]))
+            return 0;
+    return !*p || *p == '/';
+}
+
+/**
+ * Turn the short name of an entry into NAME.EXT, returns its length
+ */
+static unsigned int fat_shortname(unsigned char *e, unsigned short *name)
+{
+    unsigned int j, n = 0;
+    for (j = 0; j < 8 && e[j] != ' '; j++)
+        name[n++] = e[j];
+    if (e[8] != ' ')
+        name[n++] = '.';
+    for (j = 8; j < 11 && e[j] != ' '; j++)
+        name[n++] = e[j];
+    return n;
+}
+
+/**
+ * Scan a directory. Every name (short and long) is added to idx if given,
+ * and compared against h1/h2 if found is given. Returns 1 on a match
+ */
+static int fat_scan(unsigned int cluster, fatidx_t *idx, char *name, unsigned int h1, unsigned int h2, fatent_t *found)
+{
+    unsigned short lfn[260], sn[12];
+    unsigned int sec, i, j, k, c, n, sl, a1, a2, hs[4];
+    unsigned char *e, sum = 0, lfnsum = 0;
+    int lfnok = 0, names;
+    fatdir_t *dir;
+    fatent_t *f;
+
+    for (sec = 0; fat_dirread(cluster, sec, fat_dirbuf); sec++)
+    {
+        for (e = fat_dirbuf; e < fat_dirbuf + 512; e += 32)
+        {
+            dir = (fatdir_t *)e;
+            // end of directory
+            if (e[0] == 0)
+                return 0;
+            // deleted entry
+            if (e[0] == 0xE5)
+            {
+                lfnok = 0;
+                continue;
+            }
+            // long filename part, they come last part first
+            if (e[11] == 0xF)
+            {
+                k = (e[0] & 0x1F) - 1;
+                if (e[0] & 0x40)
+                {
+                    // last part, starts a new name
+                    lfnok = k < 20;
+                    lfnsum = e[13];
+                    for (j = 0; j < 260; j++)
+                        lfn[j] = 0;
+                }
+                if (lfnok && k < 20 && e[13] == lfnsum)
+                    for (j = 0; j < 13; j++)
+                        lfn[k * 13 + j] = e[fat_lfnoffs[j]] | (e[fat_lfnoffs[j] + 1] << 8);
+                else
+                    lfnok = 0;
+                continue;
+            }
+            // volume label
+            if (e[11] & 8)
+            {
+                lfnok = 0;
+                continue;
+            }
+            // hash the short name as NAME.EXT
+            a1 = 2166136261;
+            a2 = 5381;
+            sl = fat_shortname(e, sn);
+            for (j = 0; j < sl; j++)
+                fat_hash(sn[j], &a1, &a2);
+            hs[0] = a1;
+            hs[1] = a2;
+            names = 1;
+            // the long name belongs to this entry if the checksum matches
+            for (sum = 0, j = 0; j < 11; j++)
+                sum = ((sum & 1) << 7) + (sum >> 1) + e[j];
+            if (lfnok && sum == lfnsum)
+            {
+                a1 = 2166136261;
+                a2 = 5381;
+                for (j = 0; j < 260 && (c = lfn[j]) && c != 0xFFFF; j++)
+                    fat_hash(c, &a1, &a2);
+                hs[2] = a1;
+                hs[3] = a2;
+                names = 2;
+            }
+            lfnok = 0;
+            for (n = 0; n < names; n++)
+            {
+                if (idx && idx->count < FAT_DIRENTS)
+                {
+                    f = &idx->ent[idx->count++];
+                    f->h1 = hs[n * 2];
+                    f->h2 = hs[n * 2 + 1];
+                    f->cluster = ((unsigned int)dir->ch) << 16 | dir->cl;
+                    f->size = dir->size;
+                    f->pos = sec * 16 + (e - fat_dirbuf) / 32;
+                    f->attr = e[11];
+                    i = f->h1 % FAT_DIRHASH;
+                    f->next = idx->hash[i];
+                    idx->hash[i] = idx->count;
+                }
+                else if (idx)
+                    idx->full = 1;
+                // equal hashes could still be a collision, check the name
+                if (found && hs[n * 2] == h1 && hs[n * 2 + 1] == h2 &&
+                    fat_namecmp(name, n ? lfn : sn, n ? 260 : sl))
+                {
+                    found->cluster = ((unsigned int)dir->ch) << 16 | dir->cl;
+                    found->size = dir->size;
+                    found->pos = sec * 16 + (e - fat_dirbuf) / 32;
+                    found->attr = e[11];
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Return the lookup index of a directory, building it on first use
+ */
+static fatidx_t *fat_index(unsigned int cluster)
+{
+    fatidx_t *idx = &fat_idx[0];
+    int i;
+    for (i = 0; i < FAT_DIRCACHE; i++)
+    {
+        if (fat_idx[i].valid && fat_idx[i].cluster == cluster)
+        {
+            fat_idx[i].stamp = ++fat_idxclock;
+            return &fat_idx[i];
+        }
+        if (!fat_idx[i].valid || fat_idx[i].stamp < idx->stamp)
+            idx = &fat_idx[i];
+    }
+    idx->cluster = cluster;
+    idx->count = idx->full = 0;
+    for (i = 0; i < FAT_DIRHASH; i++)
+        idx->hash[i] = 0;
+    fat_scan(cluster, idx, 0, 0, 0, 0);
+    idx->valid = 1;
+    idx->stamp = ++fat_idxclock;
+    log_trace("FAT indexed directory, entries", cluster, idx->count);
+    return idx;
+}
+
+/**
+ * Check that entry pos of a directory is called name (up to the next '/'),
+ * as its short name or the long name in the entries before it. An index
+ * hit only says the hashes are equal
+ */
+static int fat_namematch(unsigned int dir, unsigned int pos, char *name)
+{
+    unsigned short lfn[260];
+    unsigned int lba, j, k;
+    unsigned char *e, sum;
+
+    if (!(e = fat_direntry(dir, pos, &lba)))
+        return 0;
+    if (fat_namecmp(name, lfn, fat_shortname(e, lfn)))
+        return 1;
+    for (sum = 0, j = 0; j < 11; j++)
+        sum = ((sum & 1) << 7) + (sum >> 1) + e[j];
+    // the long name parts are stored last part first, part k at pos - k
+    for (k = 1; k <= 20 && k <= pos; k++)
+    {
+        if (!(e = fat_direntry(dir, pos - k, &lba)) || e[11] != 0xF || e[0] == 0xE5 ||
+            (e[0] & 0x1F) != k || e[13] != sum)
+            return 0;
+        for (j = 0; j < 13; j++)
+            lfn[(k - 1) * 13 + j] = e[fat_lfnoffs[j]] | (e[fat_lfnoffs[j] + 1] << 8);
+        if (e[0] & 0x40)
+            return fat_namecmp(name, lfn, k * 13);
+    }
+    return 0;
+}
+
+/**
+ * Resolve a path like /dir/sub/file.ext, long or short names, from the root
+ * directory. Returns 1 and fills in the entry and its directory if it exists
+ */
+static int fat_resolve(char *path, fatent_t *found, unsigned int *parent)
+{
+    unsigned int dir = fat_root(), h1, h2, i;
+    fatidx_t *idx;
+    fatent_t *f;
+    char *name;
+
+    // the root itself
+    found->cluster = *parent = dir;
+    found->size = found->pos = 0;
+    found->attr = 0x10;
+    while (*path)
+    {
+        if (*path == '/')
+        {
+            path++;
+            continue;
+        }
+        if (!(found->attr & 0x10))
+            return 0;
+        dir = *parent = found->cluster;
+        name = path;
+        fat_hashpath(&path, &h1, &h2);
+        idx = fat_index(dir);
+        for (i = idx->hash[h1 % FAT_DIRHASH]; i; i = f->next)
+        {
+            f = &idx->ent[i - 1];
+            if (f->h1 == h1 && f->h2 == h2 && fat_namematch(dir, f->pos, name))
+                break;
+        }
+        if (i)
+        {
+            found->cluster = f->cluster;
+            found->size = f->size;
+            found->pos = f->pos;
+            found->attr = f->attr;
+        }
+        else if (!idx->full || !fat_scan(dir, 0, name, h1, h2, found))
+            return 0;
+        // ".." pointing to the root says cluster 0, even on FAT32
+        if (!found->cluster && (found->attr & 0x10))
+            found->cluster = fat_root();
+    }
+    return 1;
+}
 
 /**
  * Get the starting LBA address of the first partition
@@ -69,51 +677,70 @@ int fat_getpartition(void)
 {
 
     unsigned char *mbr = fat_buf;
-    bpb_t *bpb = (bpb_t *)fat_buf;
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    int i;
     // read the partitioning table
-    if (sd_readblock(0, fat_buf, 1))
+    if (bcache_read(0, fat_buf, 1))
     {
         // check magic
         if (mbr[510] != 0x55 || mbr[511] != 0xAA)
         {
-            uart_puts("ERROR: Bad magic in MBR\n");
+            log_error("ERROR: Bad magic in MBR\n");
             return 0;
         }
         // check partition type
         if (mbr[0x1C2] != 0xE /*FAT16 LBA*/ && mbr[0x1C2] != 0xC /*FAT32 LBA*/)
         {
-            uart_puts("ERROR: Wrong partition type\n");
+            log_error("ERROR: Wrong partition type\n");
             return 0;
         }
-        uart_puts("MBR disk identifier: ");
-        uart_hex(((uint32_t)mbr[0x1B8]) | ((uint32_t)mbr[0x1B9] << 8) |
-                 ((uint32_t)mbr[0x1BA] << 16) | ((uint32_t)mbr[0x1BB] << 24));
-        uart_puts("\nFAT partition starts at: ");
+        log_infox("MBR disk identifier: ", ((uint32_t)mbr[0x1B8]) | ((uint32_t)mbr[0x1B9] << 8) |
+                                               ((uint32_t)mbr[0x1BA] << 16) | ((uint32_t)mbr[0x1BB] << 24));
         // should be this, but compiler generates bad code...
         // partitionlba=*((unsigned int*)((unsigned long)&_end+0x1C6));
         partitionlba = ((uint32_t)mbr[0x1C6]) |
                        ((uint32_t)mbr[0x1C7] << 8) |
                        ((uint32_t)mbr[0x1C8] << 16) |
                        ((uint32_t)mbr[0x1C9] << 24);
-        uart_hex(partitionlba);
-        uart_puts("\n");
+        log_infox("FAT partition starts at: ", partitionlba);
+        // forget FAT sectors of whatever was mounted before
+        for (i = 0; i < FAT_WINDOW; i++)
+            fat_win[i].valid = 0;
+        for (i = 0; i < FAT_DIRCACHE; i++)
+            fat_idx[i].valid = 0;
+        for (i = 0; i < FAT_BITMAP / 16; i++)
+            fat_scanned[i] = 0;
+        fat_dirfile.cluster = 0;
+        fat_dmin = -1;
+        fat_dmax = fat_infodirty = 0;
         // read the boot record
-        if (!sd_readblock(partitionlba, fat_buf, 1))
+        if (!bcache_read(partitionlba, fat_vbr, 1))
         {
-            uart_puts("ERROR: Unable to read boot record\n");
+            log_error("ERROR: Unable to read boot record\n");
             return 0;
         }
         // check file system type. We don't use cluster numbers for that, but magic bytes
         if (!(bpb->fst[0] == 'F' && bpb->fst[1] == 'A' && bpb->fst[2] == 'T') &&
             !(bpb->fst2[0] == 'F' && bpb->fst2[1] == 'A' && bpb->fst2[2] == 'T'))
         {
-            uart_puts("ERROR: Unknown file system type\n");
+            log_error("ERROR: Unknown file system type\n");
             return 0;
         }
-        uart_puts("FAT type: ");
         // if 16 bit sector per fat is zero, then it's a FAT32
-        uart_puts(bpb->spf16 > 0 ? "FAT16" : "FAT32");
-        uart_puts("\n");
+        log_info(bpb->spf16 > 0 ? "FAT type: FAT16\n" : "FAT type: FAT32\n");
+        // start allocating where FSInfo says the free space is
+        fat_hint = 2;
+        fat_freecnt = -1;
+        if (bpb->spf16 == 0 && bcache_read(partitionlba + (bpb->vol[0] | (bpb->vol[1] << 8)), fat_fsinfo, 1) &&
+            *((unsigned int *)fat_fsinfo) == 0x41615252 && *((unsigned int *)(fat_fsinfo + 484)) == 0x61417272)
+        {
+            fat_freecnt = *((unsigned int *)(fat_fsinfo + 488));
+            fat_hint = *((unsigned int *)(fat_fsinfo + 492));
+            if (fat_hint < 2 || fat_hint > fat_maxclust())
+                fat_hint = 2;
+            if (fat_freecnt > fat_maxclust())
+                fat_freecnt = -1;
+        }
         return 1;
     }
     return 0;
@@ -124,34 +751,25 @@ int fat_getpartition(void)
  */
 void fat_listdirectory(void)
 {
-    bpb_t *bpb = (bpb_t *)fat_buf;
-    fatdir_t *dir = (fatdir_t *)fat_buf;
-    unsigned int root_sec, s;
-    // find the root directory's LBA
-    root_sec = ((bpb->spf16 ? bpb->spf16 : bpb->spf32) * bpb->nf) + bpb->rsc;
-    s = (bpb->nr0 + (bpb->nr1 << 8));
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    fatdir_t *dir;
+    unsigned int i;
     uart_puts("FAT number of root diretory entries: ");
-    uart_hex(s);
-    s *= sizeof(fatdir_t);
-    if (bpb->spf16 == 0)
-    {
-        // adjust for FAT32
-        root_sec += (bpb->rc - 2) * bpb->spc;
-    }
-    // add partition LBA
-    root_sec += partitionlba;
-    uart_puts("\nFAT root directory LBA: ");
-    uart_hex(root_sec);
+    uart_hex(bpb->nr0 + (bpb->nr1 << 8));
+    uart_puts("\nFAT root directory cluster: ");
+    uart_hex(fat_root());
     uart_puts("\n");
-    // load the root directory
-    if (sd_readblock(root_sec, fat_buf, s / 512 + 1))
+    uart_puts("\nAttrib Cluster  Size     Name\n");
+    // load the root directory a sector at a time, the cache keeps it around
+    for (i = 0; fat_dirread(fat_root(), i, fat_buf); i++)
     {
-        uart_puts("\nAttrib Cluster  Size     Name\n");
         // iterate on each entry and print out
-        for (; dir->name[0] != 0; dir++)
+        for (dir = (fatdir_t *)fat_buf; dir < (fatdir_t *)(fat_buf + 512); dir++)
         {
+            if (dir->name[0] == 0)
+                return;
             // is it a valid entry?
-            if (dir->name[0] == 0xE5 || dir->attr[0] == 0xF)
+            if ((unsigned char)dir->name[0] == 0xE5 || dir->attr[0] == 0xF)
                 continue;
             // decode attributes
             uart_send(dir->attr[0] & 1 ? 'R' : '.');  // read-only
@@ -173,111 +791,799 @@ void fat_listdirectory(void)
             uart_puts("\n");
         }
     }
-    else
+}
+
+/**
+ * Find a file by path, return its first cluster
+ */
+unsigned int fat_getcluster(char *fn)
+{
+    fatent_t f;
+    unsigned int dir;
+    if (!fat_resolve(fn, &f, &dir))
     {
-        uart_puts("ERROR: Unable to load root directory\n");
+        log_error("ERROR: file not found\n");
+        return 0;
     }
+    log_trace("FAT File starts at cluster", f.cluster, f.size);
+    return f.cluster;
 }
 
 /**
- * Find a file in root directory entries
+ * Read a file into memory
  */
-unsigned int fat_getcluster(char *fn)
+char *fat_readfile(unsigned int cluster)
 {
-    bpb_t *bpb = (bpb_t *)fat_buf;
-    fatdir_t *dir = (fatdir_t *)(fat_buf + 512);
-    unsigned int root_sec, s;
-    // find the root directory's LBA
-    root_sec = ((bpb->spf16 ? bpb->spf16 : bpb->spf32) * bpb->nf) + bpb->rsc;
-    s = (bpb->nr0 + (bpb->nr1 << 8)) * sizeof(fatdir_t);
-    if (bpb->spf16 == 0)
+    // BIOS Parameter Block
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    // Data pointers
+    unsigned int data_sec, first, next, n;
+    unsigned char *data, *ptr;
+    // find the LBA of the first data sector
+    data_sec = fat_datasec();
+    // dump important properties
+    log_trace("FAT Bytes per Sector, Sectors per Cluster", bpb->bps0 + (bpb->bps1 << 8), bpb->spc);
+    log_trace("FAT Number of FAT, Sectors per FAT", bpb->nf, (bpb->spf16 ? bpb->spf16 : bpb->spf32));
+    log_trace("FAT Reserved Sectors Count, First data sector", bpb->rsc, data_sec);
+    // the file goes to free memory after the kernel, cache line aligned for DMA
+    data = ptr = (unsigned char *)(((unsigned long)&_end + 63) & ~63UL);
+    // iterate on cluster chain, reading each run of consecutive clusters in one go.
+    // FAT sectors are loaded on demand, fat_next() returns 0 at the end of chain
+    while (cluster)
     {
-        // adjust for FAT32
-        root_sec += (bpb->rc - 2) * bpb->spc;
+        // extend the run while the next cluster follows this one
+        first = cluster;
+        n = 1;
+        while ((next = fat_next(cluster)) == cluster + 1 && (n + 1) * bpb->spc <= FAT_MAX_XFER)
+        {
+            cluster = next;
+            n++;
+        }
+        // load all sectors of the run
+        if (!bcache_read((first - 2) * bpb->spc + data_sec, ptr, n * bpb->spc))
+        {
+            log_error("ERROR: Unable to read file\n");
+            break;
+        }
+        // move pointer, sector per cluster * bytes per sector
+        ptr += n * bpb->spc * (bpb->bps0 + (bpb->bps1 << 8));
+        // continue with the cluster after the run
+        cluster = next;
     }
-    // add partition LBA
-    root_sec += partitionlba;
-    // load the root directory
-    if (sd_readblock(root_sec, (unsigned char *)dir, s / 512 + 1))
+    return (char *)data;
+}
+
+/**
+ * Look up a file by path and prepare it for fat_pread()
+ */
+int fat_lookup(char *fn, fat_file_t *file)
+{
+    fatent_t f;
+    unsigned int dir;
+    if (!fat_resolve(fn, &f, &dir) || (f.attr & 0x10))
     {
-        // iterate on each entry and check if it's the one we're looking for
-        for (; dir->name[0] != 0; dir++)
+        log_error("ERROR: file not found\n");
+        return 0;
+    }
+    log_trace("FAT File starts at cluster", f.cluster, f.size);
+    file->cluster = file->next = f.cluster;
+    file->size = f.size;
+    file->mapped = file->count = file->pos = file->dirty = 0;
+    file->dir = dir;
+    file->dirent = f.pos;
+    return 1;
+}
+
+/**
+ * Find the cluster at index idx of a file, and how many consecutive clusters
+ * follow it. The extent map grows on demand. A file with more runs than
+ * FAT_EXTENTS gets a sparser map, reads in its gaps walk the few runs there
+ */
+static unsigned int fat_locate(fat_file_t *file, unsigned int idx, unsigned int *run)
+{
+    unsigned int lo, hi, mid, c, n;
+    fat_extent_t *e;
+
+    // extend the map up to idx, one extent per run of consecutive clusters.
+    // A full map keeps every other extent, the runs in between are walked
+    while (idx >= file->mapped && file->next)
+    {
+        if (file->count == FAT_EXTENTS)
         {
-            // is it a valid entry?
-            if (dir->name[0] == 0xE5 || dir->attr[0] == 0xF)
-                continue;
-            // filename match?
-            if (!memcmp(dir->name, fn, 11))
+            for (n = 1; n < FAT_EXTENTS / 2; n++)
+                file->ext[n] = file->ext[n * 2];
+            file->count = FAT_EXTENTS / 2;
+        }
+        e = &file->ext[file->count++];
+        e->offs = file->mapped;
+        e->clust = c = file->next;
+        for (n = 1; (file->next = fat_next(c)) == c + 1; n++)
+            c++;
+        e->len = n;
+        file->mapped += n;
+    }
+    if (idx >= file->mapped)
+        return 0;
+    // binary search the last extent starting at or before idx
+    lo = 0;
+    hi = file->count - 1;
+    while (lo < hi)
+    {
+        mid = (lo + hi + 1) / 2;
+        if (file->ext[mid].offs <= idx)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    e = &file->ext[lo];
+    if (idx < e->offs + e->len)
+    {
+        *run = e->len - (idx - e->offs);
+        return e->clust + idx - e->offs;
+    }
+    // in a gap of a thinned out map, walk on from the end of the extent
+    for (c = e->clust + e->len - 1, n = e->offs + e->len - 1; c && n < idx; n++)
+        c = fat_next(c);
+    if (!c)
+        return 0;
+    for (n = 1, lo = c; fat_next(lo) == lo + 1; n++)
+        lo++;
+    *run = n;
+    return c;
+}
+
+/**
+ * Read len bytes from offset in a file. Returns the number of bytes read
+ */
+unsigned int fat_pread(fat_file_t *file, unsigned int offset, unsigned char *buffer, unsigned int len)
+{
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    unsigned int csize = bpb->spc * 512, data_sec = fat_datasec();
+    unsigned int clust, run, lba, n, i, done = 0;
+
+    if (offset >= file->size)
+        return 0;
+    if (len > file->size - offset)
+        len = file->size - offset;
+    while (done < len)
+    {
+        if (!(clust = fat_locate(file, offset / csize, &run)))
+            break;
+        lba = (clust - 2) * bpb->spc + data_sec + (offset % csize) / 512;
+        if (!(offset % 512) && len - done >= 512)
+        {
+            // whole sectors go straight into the caller's buffer
+            n = run * bpb->spc - (offset % csize) / 512;
+            if (n > (len - done) / 512)
+                n = (len - done) / 512;
+            if (n > FAT_MAX_XFER)
+                n = FAT_MAX_XFER;
+            if (!bcache_read(lba, buffer + done, n))
+                break;
+            n *= 512;
+        }
+        else
+        {
+            // partial sector at either end
+            if (!bcache_read(lba, fat_buf, 1))
+                break;
+            n = 512 - offset % 512;
+            if (n > len - done)
+                n = len - done;
+            for (i = 0; i < n; i++)
+                buffer[done + i] = fat_buf[offset % 512 + i];
+        }
+        done += n;
+        offset += n;
+    }
+    return done;
+}
+
+/**
+ * Open a file by path for streaming. Returns a descriptor or -1
+ */
+int fat_open(char *fn)
+{
+    int fd;
+    for (fd = 0; fd < FAT_MAXFILES && fat_used[fd]; fd++)
+        ;
+    if (fd == FAT_MAXFILES)
+    {
+        log_error("ERROR: Too many open files\n");
+        return -1;
+    }
+    if (!fat_lookup(fn, &fat_files[fd]))
+        return -1;
+    fat_used[fd] = 1;
+    return fd;
+}
+
+/**
+ * Read the next len bytes of an open file into buffer. Returns the number
+ * of bytes read, 0 at end of file
+ */
+unsigned int fat_read(int fd, unsigned char *buffer, unsigned int len)
+{
+    unsigned int n;
+    if (fd < 0 || fd >= FAT_MAXFILES || !fat_used[fd])
+        return 0;
+    n = fat_pread(&fat_files[fd], fat_files[fd].pos, buffer, len);
+    fat_files[fd].pos += n;
+    return n;
+}
+
+/**
+ * Stream the rest of an open file through buffer, calling fn for each
+ * contiguous piece as soon as it has arrived. A piece never crosses an
+ * extent, so each one is a single read from the card. Returns the number
+ * of bytes delivered
+ */
+unsigned int fat_readextents(int fd, unsigned char *buffer, unsigned int len, fat_extent_fn fn, void *arg)
+{
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    unsigned int csize = bpb->spc * 512, run, n, done = 0;
+    fat_file_t *file;
+
+    if (fd < 0 || fd >= FAT_MAXFILES || !fat_used[fd])
+        return 0;
+    file = &fat_files[fd];
+    while (file->pos < file->size)
+    {
+        if (!fat_locate(file, file->pos / csize, &run))
+            break;
+        // the rest of this extent, as much as fits in the buffer
+        n = run * csize - file->pos % csize;
+        if (n > len)
+            n = len;
+        if (!(n = fat_read(fd, buffer, n)))
+            break;
+        done += n;
+        if (!fn(buffer, n, arg))
+            break;
+    }
+    return done;
+}
+
+/**
+ * Close a file descriptor, writing back its changes first
+ */
+void fat_close(int fd)
+{
+    if (fd >= 0 && fd < FAT_MAXFILES)
+    {
+        if (fat_used[fd] && fat_files[fd].dirty)
+            fat_sync();
+        fat_used[fd] = 0;
+    }
+}
+
+/**
+ * Return the lookup index of a directory if it has one, without building it
+ */
+static fatidx_t *fat_findidx(unsigned int dir)
+{
+    int i;
+    for (i = 0; i < FAT_DIRCACHE; i++)
+        if (fat_idx[i].valid && fat_idx[i].cluster == dir)
+            return &fat_idx[i];
+    return 0;
+}
+
+/**
+ * Add a new short name entry to its directory's index. When it doesn't fit,
+ * the index is marked full and misses scan the directory again
+ */
+static void fat_idxadd(unsigned int dir, unsigned int pos, unsigned char *e)
+{
+    fatidx_t *idx = fat_findidx(dir);
+    unsigned short sn[12];
+    unsigned int i, n;
+    fatent_t *f;
+
+    if (!idx)
+        return;
+    if (idx->count == FAT_DIRENTS)
+    {
+        idx->full = 1;
+        return;
+    }
+    f = &idx->ent[idx->count++];
+    f->h1 = 2166136261;
+    f->h2 = 5381;
+    n = fat_shortname(e, sn);
+    for (i = 0; i < n; i++)
+        fat_hash(sn[i], &f->h1, &f->h2);
+    f->cluster = ((unsigned int)((fatdir_t *)e)->ch) << 16 | ((fatdir_t *)e)->cl;
+    f->size = ((fatdir_t *)e)->size;
+    f->pos = pos;
+    f->attr = e[11];
+    i = f->h1 % FAT_DIRHASH;
+    f->next = idx->hash[i];
+    idx->hash[i] = idx->count;
+}
+
+/**
+ * Unlink the names of a deleted entry from its directory's index, their
+ * slots stay unused until the index is built again
+ */
+static void fat_idxdel(unsigned int dir, unsigned int pos)
+{
+    fatidx_t *idx = fat_findidx(dir);
+    unsigned short *p;
+    unsigned int i;
+
+    for (i = 0; idx && i < FAT_DIRHASH; i++)
+        for (p = &idx->hash[i]; *p;)
+            if (idx->ent[*p - 1].pos == pos)
+                *p = idx->ent[*p - 1].next;
+            else
+                p = &idx->ent[*p - 1].next;
+}
+
+/**
+ * Update the first cluster and size of an entry in its directory's index
+ */
+static void fat_idxset(unsigned int dir, unsigned int pos, unsigned int cluster, unsigned int size)
+{
+    fatidx_t *idx = fat_findidx(dir);
+    unsigned int i;
+
+    // a long name and its short alias both point at the entry
+    for (i = 0; idx && i < idx->count; i++)
+        if (idx->ent[i].pos == pos)
+        {
+            idx->ent[i].cluster = cluster;
+            idx->ent[i].size = size;
+        }
+}
+
+/**
+ * Load the sector holding entry pos of a directory into fat_dirbuf and
+ * return the entry, 0 past the end of the directory
+ */
+static unsigned char *fat_direntry(unsigned int dir, unsigned int pos, unsigned int *lba)
+{
+    if (!(*lba = fat_dirlba(dir, pos / 16)) || !bcache_read(*lba, fat_dirbuf, 1))
+        return 0;
+    return fat_dirbuf + (pos % 16) * 32;
+}
+
+/**
+ * Allocate up to want free clusters in a single run, preferring the ones
+ * right after prefer so that a growing file stays contiguous. The run is
+ * chained and terminated. Returns its first cluster, 0 if the volume is full
+ */
+static unsigned int fat_alloc(unsigned int want, unsigned int prefer, unsigned int *got)
+{
+    unsigned int maxc = fat_maxclust(), c, i, first = 0, run = 0, best = 0, bestlen = 0;
+    int used;
+
+    c = prefer ? prefer + 1 : fat_hint;
+    if (c < 2 || c > maxc)
+        c = 2;
+    // first fit, remembering the longest run in case none is long enough
+    for (i = 0; i < maxc - 1 && bestlen < want; i++)
+    {
+        // runs don't wrap around the end of the volume
+        if (c == 2)
+            run = 0;
+        if ((used = fat_inuse(c)) < 0)
+        {
+            log_error("ERROR: Unable to read the FAT\n");
+            return 0;
+        }
+        if (used)
+            run = 0;
+        else
+        {
+            if (!run++)
+                first = c;
+            if (run > bestlen)
             {
-                uart_puts("FAT File ");
-                uart_puts(fn);
-                uart_puts(" starts at cluster: ");
-                uart_hex(((unsigned int)dir->ch) << 16 | dir->cl);
-                uart_puts("\n");
-                // if so, return starting cluster
-                return ((unsigned int)dir->ch) << 16 | dir->cl;
+                best = first;
+                bestlen = run;
             }
         }
-        uart_puts("ERROR: file not found\n");
+        c = c < maxc ? c + 1 : 2;
+    }
+    if (!bestlen)
+    {
+        log_error("ERROR: No free clusters\n");
+        return 0;
+    }
+    for (i = 0; i < bestlen; i++)
+        if (!fat_set(best + i, i + 1 < bestlen ? best + i + 1 : -1))
+            return 0;
+    fat_hint = best + bestlen;
+    if (fat_freecnt != -1)
+        fat_freecnt -= bestlen;
+    fat_infodirty = 1;
+    *got = bestlen;
+    return best;
+}
+
+/**
+ * Free a cluster chain
+ */
+static void fat_freechain(unsigned int cluster)
+{
+    unsigned int next;
+    while (cluster)
+    {
+        next = fat_next(cluster);
+        if (!fat_set(cluster, 0))
+            return;
+        if (fat_freecnt != -1)
+            fat_freecnt++;
+        fat_infodirty = 1;
+        cluster = next;
+    }
+}
+
+/**
+ * Write len bytes at offset into clusters the file already has
+ */
+static unsigned int fat_pwrite(fat_file_t *file, unsigned int offset, unsigned char *buffer, unsigned int len)
+{
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    unsigned int csize = bpb->spc * 512, data_sec = fat_datasec();
+    unsigned int clust, run, lba, n, i, done = 0;
+
+    while (done < len)
+    {
+        if (!(clust = fat_locate(file, offset / csize, &run)))
+            break;
+        lba = (clust - 2) * bpb->spc + data_sec + (offset % csize) / 512;
+        if (!(offset % 512) && len - done >= 512)
+        {
+            // whole sectors go straight from the caller's buffer
+            n = run * bpb->spc - (offset % csize) / 512;
+            if (n > (len - done) / 512)
+                n = (len - done) / 512;
+            if (n > FAT_MAX_XFER)
+                n = FAT_MAX_XFER;
+            if (!bcache_write(lba, buffer + done, n))
+                break;
+            n *= 512;
+        }
+        else
+        {
+            // partial sector, read-modify-write
+            if (!bcache_read(lba, fat_buf, 1))
+                break;
+            n = 512 - offset % 512;
+            if (n > len - done)
+                n = len - done;
+            for (i = 0; i < n; i++)
+                fat_buf[offset % 512 + i] = buffer[done + i];
+            if (!bcache_write(lba, fat_buf, 1))
+                break;
+        }
+        done += n;
+        offset += n;
+    }
+    return done;
+}
+
+/**
+ * Append len bytes to an open file. New clusters are allocated in as few
+ * runs as possible. Returns the number of bytes written, the directory
+ * entry and the FAT are updated on fat_sync() or fat_close()
+ */
+unsigned int fat_write(int fd, unsigned char *buffer, unsigned int len)
+{
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    unsigned int csize = bpb->spc * 512, have, need, last = 0, first, got, run, n;
+    fat_file_t *file;
+
+    if (fd < 0 || fd >= FAT_MAXFILES || !fat_used[fd])
+        return 0;
+    file = &fat_files[fd];
+    have = (file->size + csize - 1) / csize;
+    need = (file->size + len + csize - 1) / csize;
+    if (need > have)
+    {
+        if (have && !(last = fat_locate(file, have - 1, &run)))
+            return 0;
+        while (have < need)
+        {
+            if (!(first = fat_alloc(need - have, last, &got)))
+                break;
+            if (last)
+                fat_set(last, first);
+            else
+                file->cluster = first;
+            last = first + got - 1;
+            have += got;
+        }
+        // the extent map stopped at the old end of chain
+        file->next = file->cluster;
+        file->mapped = file->count = 0;
+        file->dirty = 1;
+    }
+    // as much as fits in the clusters we got
+    if (len > have * csize - file->size)
+        len = have * csize - file->size;
+    if ((n = fat_pwrite(file, file->size, buffer, len)))
+    {
+        file->size += n;
+        file->dirty = 1;
+    }
+    return n;
+}
+
+/**
+ * Shrink an open file to size bytes, freeing the clusters past it
+ */
+int fat_truncate(int fd, unsigned int size)
+{
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    unsigned int csize = bpb->spc * 512, keep, c, next, run;
+    fat_file_t *file;
+
+    if (fd < 0 || fd >= FAT_MAXFILES || !fat_used[fd])
+        return 0;
+    file = &fat_files[fd];
+    if (size >= file->size)
+        return size == file->size;
+    keep = (size + csize - 1) / csize;
+    if (keep)
+    {
+        if (!(c = fat_locate(file, keep - 1, &run)))
+            return 0;
+        next = fat_next(c);
+        if (next && !fat_set(c, -1))
+            return 0;
     }
     else
     {
-        uart_puts("ERROR: Unable to load root directory\n");
+        next = file->cluster;
+        file->cluster = 0;
     }
-    return 0;
+    fat_freechain(next);
+    file->size = size;
+    if (file->pos > size)
+        file->pos = size;
+    file->next = file->cluster;
+    file->mapped = file->count = 0;
+    file->dirty = 1;
+    return 1;
 }
 
 /**
- * Read a file into memory
+ * Convert a file name to a space padded 8.3 entry name, 0 if it isn't one
  */
-char *fat_readfile(unsigned int cluster)
+static int fat_83name(char *fn, char *name)
 {
-    // BIOS Parameter Block
-    bpb_t *bpb = (bpb_t *)fat_buf;
-    // File allocation tables. We choose between FAT16 and FAT32 dynamically
-    unsigned int *fat32 = (unsigned int *)(fat_buf + bpb->rsc * 512);
-    unsigned short *fat16 = (unsigned short *)fat32;
-    // Data pointers
-    unsigned int data_sec, s;
-    unsigned char *data, *ptr;
-    // find the LBA of the first data sector
-    data_sec = ((bpb->spf16 ? bpb->spf16 : bpb->spf32) * bpb->nf) + bpb->rsc;
-    s = (bpb->nr0 + (bpb->nr1 << 8)) * sizeof(fatdir_t);
-    if (bpb->spf16 > 0)
+    static const char special[] = "!#$%&'()-@^_`{}~";
+    unsigned int i, j, n = 0;
+    char c;
+    for (i = 0; i < 11; i++)
+        name[i] = ' ';
+    for (i = 0; (c = *fn); fn++)
     {
-        // adjust for FAT16
-        data_sec += (s + 511) >> 9;
+        if (c == '.')
+        {
+            // one dot, not first, followed by the extension
+            if (n++ || !i)
+                return 0;
+            i = 8;
+            continue;
+        }
+        if (i == (n ? 11 : 8))
+            return 0;
+        if (c >= 'a' && c <= 'z')
+            c -= 'a' - 'A';
+        if (!((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')))
+        {
+            for (j = 0; special[j] && special[j] != c; j++)
+                ;
+            if (!special[j])
+                return 0;
+        }
+        name[i++] = c;
     }
-    // add partition LBA
-    data_sec += partitionlba;
-    // dump important properties
-    uart_puts("FAT Bytes per Sector: ");
-    uart_hex(bpb->bps0 + (bpb->bps1 << 8));
-    uart_puts("\nFAT Sectors per Cluster: ");
-    uart_hex(bpb->spc);
-    uart_puts("\nFAT Number of FAT: ");
-    uart_hex(bpb->nf);
-    uart_puts("\nFAT Sectors per FAT: ");
-    uart_hex((bpb->spf16 ? bpb->spf16 : bpb->spf32));
-    uart_puts("\nFAT Reserved Sectors Count: ");
-    uart_hex(bpb->rsc);
-    uart_puts("\nFAT First data sector: ");
-    uart_hex(data_sec);
-    uart_puts("\n");
-    // load FAT table
-    s = sd_readblock(partitionlba + 1, (unsigned char *)fat_buf + 512, (bpb->spf16 ? bpb->spf16 : bpb->spf32) + bpb->rsc);
-    // end of FAT in memory
-    data = ptr = fat_buf + 512 + s;
-    // iterate on cluster chain
-    // (Yep, MS is full of lies. FAT32 is actually FAT28 only, no mistake, the upper 4 bits must be zero)
-    while (cluster > 1 && cluster < (bpb->spf16 > 0 ? 0xFFF8 : 0x0FFFFFF8))
+    return i > 0;
+}
+
+/**
+ * Create an empty file and open it. Only 8.3 names are created, the
+ * directory it goes in must exist. Returns a descriptor or -1
+ */
+int fat_create(char *fn)
+{
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    unsigned int dir, lba = 0, sec, pos = 0, first, got, run, i;
+    char name[11], *base, *p;
+    unsigned char *e = 0;
+    fatent_t f;
+    int fd;
+
+    for (fd = 0; fd < FAT_MAXFILES && fat_used[fd]; fd++)
+        ;
+    if (fd == FAT_MAXFILES)
     {
-        // load all sectors in a cluster
-        sd_readblock((cluster - 2) * bpb->spc + data_sec, ptr, bpb->spc);
-        // move pointer, sector per cluster * bytes per sector
-        ptr += bpb->spc * (bpb->bps0 + (bpb->bps1 << 8));
-        // get the next cluster in chain
-        cluster = bpb->spf16 > 0 ? fat16[cluster] : fat32[cluster];
+        log_error("ERROR: Too many open files\n");
+        return -1;
     }
-    return (char *)data;
-}
\ No newline at end of file
+    if (fat_resolve(fn, &f, &dir))
+    {
+        log_error("ERROR: File exists\n");
+        return -1;
+    }
+    // split off the last component, the rest must be a directory
+    for (base = p = fn; *p; p++)
+        if (*p == '/')
+            base = p + 1;
+    if (base - fn >= sizeof(fat_path))
+        return -1;
+    for (i = 0; fn + i < base; i++)
+        fat_path[i] = fn[i];
+    fat_path[i] = 0;
+    if (!fat_resolve(fat_path, &f, &dir) || !(f.attr & 0x10))
+    {
+        log_error("ERROR: Directory not found\n");
+        return -1;
+    }
+    dir = f.cluster;
+    if (!fat_83name(base, name))
+    {
+        log_error("ERROR: Only 8.3 names can be created\n");
+        return -1;
+    }
+    // look for a free slot
+    for (sec = 0; (lba = fat_dirlba(dir, sec)); sec++)
+    {
+        if (!bcache_read(lba, fat_dirbuf, 1))
+            return -1;
+        for (i = 0; i < 16; i++)
+            if (fat_dirbuf[i * 32] == 0 || fat_dirbuf[i * 32] == 0xE5)
+                break;
+        if (i < 16)
+        {
+            e = fat_dirbuf + i * 32;
+            pos = sec * 16 + i;
+            break;
+        }
+    }
+    if (!e)
+    {
+        // directory is full, grow it by a zeroed cluster (the FAT16 root can't grow)
+        if (!dir || !(i = fat_locate(&fat_dirfile, sec / bpb->spc - 1, &run)) ||
+            !(first = fat_alloc(1, i, &got)) || !fat_set(i, first))
+        {
+            log_error("ERROR: Directory full\n");
+            return -1;
+        }
+        for (i = 0; i < 512; i++)
+            fat_dirbuf[i] = 0;
+        lba = (first - 2) * bpb->spc + fat_datasec();
+        for (i = 0; i < bpb->spc; i++)
+            if (!bcache_write(lba + i, fat_dirbuf, 1))
+                return -1;
+        fat_dirfile.cluster = 0;
+        e = fat_dirbuf;
+        pos = sec * 16;
+    }
+    // an empty archive file
+    for (i = 0; i < 32; i++)
+        e[i] = 0;
+    for (i = 0; i < 11; i++)
+        e[i] = name[i];
+    e[11] = 0x20;
+    if (!bcache_write(lba, fat_dirbuf, 1))
+        return -1;
+    fat_idxadd(dir, pos, e);
+    fat_files[fd].cluster = fat_files[fd].next = 0;
+    fat_files[fd].size = fat_files[fd].pos = 0;
+    fat_files[fd].mapped = fat_files[fd].count = fat_files[fd].dirty = 0;
+    fat_files[fd].dir = dir;
+    fat_files[fd].dirent = pos;
+    fat_used[fd] = 1;
+    return fd;
+}
+
+/**
+ * Delete a file that isn't open, with its long name entries
+ */
+int fat_delete(char *fn)
+{
+    unsigned int dir, lba, pos;
+    unsigned char *e;
+    fatent_t f;
+    int fd;
+
+    if (!fat_resolve(fn, &f, &dir) || (f.attr & 0x10))
+    {
+        log_error("ERROR: file not found\n");
+        return 0;
+    }
+    for (fd = 0; fd < FAT_MAXFILES; fd++)
+        if (fat_used[fd] && fat_files[fd].dir == dir && fat_files[fd].dirent == f.pos)
+        {
+            log_error("ERROR: File is open\n");
+            return 0;
+        }
+    // the short entry and the long name parts right before it
+    for (pos = f.pos + 1; pos-- > 0;)
+    {
+        if (!(e = fat_direntry(dir, pos, &lba)))
+            return 0;
+        if (pos != f.pos && (e[11] != 0xF || e[0] == 0xE5))
+            break;
+        e[0] = 0xE5;
+        if (!bcache_write(lba, fat_dirbuf, 1))
+            return 0;
+    }
+    fat_idxdel(dir, f.pos);
+    fat_freechain(f.cluster);
+    return 1;
+}
+
+/**
+ * Write back changed FAT sectors, mirror them to the other FATs in one pass,
+ * then update the directory entries of changed files and FSInfo
+ */
+int fat_sync()
+{
+    bpb_t *bpb = (bpb_t *)fat_vbr;
+    unsigned int spf = bpb->spf16 ? bpb->spf16 : bpb->spf32, fat1 = partitionlba + bpb->rsc, s, n, i, lba;
+    fatdir_t *dir;
+    int fd, r = 1;
+
+    for (i = 0; i < FAT_WINDOW; i++)
+        if (fat_win[i].valid && fat_win[i].dirty)
+        {
+            if (bcache_write(fat_win[i].lba, fat_win[i].data, 1))
+                fat_win[i].dirty = 0;
+            else
+                r = 0;
+        }
+    if (r && fat_dmin <= fat_dmax)
+    {
+        for (s = fat_dmin; s <= fat_dmax && r; s += n)
+        {
+            n = fat_dmax - s + 1;
+            if (n > FAT_MIRRORBUF)
+                n = FAT_MIRRORBUF;
+            if (!bcache_read(fat1 + s, fat_mirror, n))
+                r = 0;
+            for (i = 1; i < bpb->nf && r; i++)
+                r = bcache_write(fat1 + i * spf + s, fat_mirror, n) != 0;
+        }
+        if (r)
+        {
+            fat_dmin = -1;
+            fat_dmax = 0;
+        }
+    }
+    // the chains are on the card now, point the directory entries at them
+    for (fd = 0; fd < FAT_MAXFILES && r; fd++)
+        if (fat_used[fd] && fat_files[fd].dirty)
+        {
+            if (!(dir = (fatdir_t *)fat_direntry(fat_files[fd].dir, fat_files[fd].dirent, &lba)))
+            {
+                r = 0;
+                break;
+            }
+            dir->ch = fat_files[fd].cluster >> 16;
+            dir->cl = fat_files[fd].cluster;
+            dir->size = fat_files[fd].size;
+            // keep it dirty for the next fat_sync() if the entry didn't make it
+            if (!bcache_write(lba, fat_dirbuf, 1))
+            {
+                r = 0;
+                break;
+            }
+            fat_files[fd].dirty = 0;
+            fat_idxset(fat_files[fd].dir, fat_files[fd].dirent, fat_files[fd].cluster, fat_files[fd].size);
+        }
+    if (r && bpb->spf16 == 0 && fat_infodirty && *((unsigned int *)fat_fsinfo) == 0x41615252)
+    {
+        *((unsigned int *)(fat_fsinfo + 488)) = fat_freecnt;
+        *((unsigned int *)(fat_fsinfo + 492)) = fat_hint;
+        r = bcache_write(partitionlba + (bpb->vol[0] | (bpb->vol[1] << 8)), fat_fsinfo, 1) != 0;
+        fat_infodirty = !r;
+    }
+    return r;
+}
@@ -1,4 +1,48 @@
+// extents remembered per file, more fragmented files keep every other one
+// each time the map fills up and walk the FAT in the gaps
+#define FAT_EXTENTS 32
+
+// a run of consecutive clusters, offs and len counted in clusters
+typedef struct
+{
+    unsigned int offs;
+    unsigned int clust;
+    unsigned int len;
+} fat_extent_t;
+
+// an opened file with its lazily built extent map
+typedef struct
+{
+    unsigned int cluster;   // first cluster
+    unsigned int size;      // in bytes
+    unsigned int mapped;    // clusters covered by ext[]
+    unsigned int next;      // cluster following the mapped ones, 0 at end of chain
+    unsigned int count;     // extents in ext[]
+    unsigned int pos;       // read position for fat_read()
+    unsigned int dir;       // directory holding the entry, and its number there
+    unsigned int dirent;
+    unsigned int dirty;     // size or first cluster changed since the last fat_sync()
+    fat_extent_t ext[FAT_EXTENTS];
+} fat_file_t;
+
+// files open at the same time through fat_open()
+#define FAT_MAXFILES 4
+
+// gets each contiguous piece of a file from fat_readextents(), returns 0 to stop
+typedef int (*fat_extent_fn)(unsigned char *buffer, unsigned int len, void *arg);
+
 int fat_getpartition(void);
 void fat_listdirectory(void);
 unsigned int fat_getcluster(char *fn);
-char *fat_readfile(unsigned int cluster);
\ No newline at end of file
+char *fat_readfile(unsigned int cluster);
+int fat_lookup(char *fn, fat_file_t *file);
+unsigned int fat_pread(fat_file_t *file, unsigned int offset, unsigned char *buffer, unsigned int len);
+int fat_open(char *fn);
+unsigned int fat_read(int fd, unsigned char *buffer, unsigned int len);
+unsigned int fat_readextents(int fd, unsigned char *buffer, unsigned int len, fat_extent_fn fn, void *arg);
+void fat_close(int fd);
+int fat_create(char *fn);
+unsigned int fat_write(int fd, unsigned char *buffer, unsigned int len);
+int fat_truncate(int fd, unsigned int size);
+int fat_delete(char *fn);
+int fat_sync();
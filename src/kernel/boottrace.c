@@ -0,0 +1,114 @@
+#include "uart.h"
+#include "fat.h"
+#include "boottrace.h"
+
+typedef struct
+{
+    unsigned long t;
+    char *s;
+} boottrace_t;
+
+// longest name printed, and a table row: two 10 column numbers, 2 spaces, name, newline
+#define BOOTTRACE_NAME 32
+#define BOOTTRACE_ROW (10 + 10 + 2 + BOOTTRACE_NAME + 1)
+#define BOOTTRACE_HEADER "      usec     delta  point\n"
+
+static boottrace_t boottrace_points[BOOTTRACE_SIZE];
+static unsigned int boottrace_num = 0;
+// the timeline as text, for the UART and the file
+static char boottrace_text[sizeof(BOOTTRACE_HEADER) + BOOTTRACE_SIZE * BOOTTRACE_ROW];
+
+/**
+ * Remember when a point of the boot was reached. The counter runs from
+ * reset (QEMU too), so the first mark already shows the firmware's time.
+ * The name must be a constant string, only its pointer is kept. Only core 0
+ * marks, and the first marks come before mmu_init(): no exclusives (atomics)
+ * here, they never succeed with the MMU off.
+ */
+void boottrace_mark(char *s)
+{
+    unsigned int i = boottrace_num++;
+    if (i >= BOOTTRACE_SIZE)
+        return;
+    asm volatile("mrs %0, cntpct_el0" : "=r"(boottrace_points[i].t));
+    boottrace_points[i].s = s;
+}
+
+/**
+ * Append a number right aligned in w columns
+ */
+static char *boottrace_dec(char *p, unsigned long v, int w)
+{
+    char d[20];
+    int n = 0;
+    do
+    {
+        d[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v && n < 20);
+    for (; w > n; w--)
+        *p++ = ' ';
+    while (n)
+        *p++ = d[--n];
+    return p;
+}
+
+/**
+ * Format the timeline: microseconds since reset, since the previous point, and the name
+ */
+static unsigned int boottrace_format()
+{
+    unsigned long f, prev = 0, us;
+    unsigned int i, num = boottrace_num < BOOTTRACE_SIZE ? boottrace_num : BOOTTRACE_SIZE;
+    char *p = boottrace_text, *s, *h = BOOTTRACE_HEADER;
+
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(f));
+    while (*h)
+        *p++ = *h++;
+    for (i = 0; i < num; i++)
+    {
+        // 10 digits is almost three hours, keep the row within BOOTTRACE_ROW
+        us = boottrace_points[i].t * 1000 / (f / 1000);
+        if (us > 9999999999UL)
+            us = 9999999999UL;
+        p = boottrace_dec(p, us, 10);
+        p = boottrace_dec(p, us - prev, 10);
+        *p++ = ' ';
+        *p++ = ' ';
+        for (s = boottrace_points[i].s; *s && s - boottrace_points[i].s < BOOTTRACE_NAME; s++)
+            *p++ = *s;
+        *p++ = '\n';
+        prev = us;
+    }
+    *p = 0;
+    return p - boottrace_text;
+}
+
+/**
+ * Print the timeline as a table
+ */
+void boottrace_dump()
+{
+    boottrace_format();
+    uart_puts(boottrace_text);
+}
+
+/**
+ * Write the timeline to a file (8.3 name), replacing it. Returns 1 on success
+ */
+int boottrace_save(char *fn)
+{
+    unsigned int len = boottrace_format();
+    int fd, r;
+
+    fd = fat_open(fn);
+    if (fd >= 0)
+        fat_truncate(fd, 0);
+    else
+        fd = fat_create(fn);
+    if (fd < 0)
+        return 0;
+    r = fat_write(fd, (unsigned char *)boottrace_text, len) == len;
+    fat_close(fd);
+    return r;
+}
@@ -0,0 +1,20 @@
+/* boot timeline, build with make BOOTTRACE=1, otherwise the calls compile out */
+
+// named points kept, later ones are dropped
+#ifndef BOOTTRACE_SIZE
+#define BOOTTRACE_SIZE 64
+#endif
+
+void boottrace_mark(char *s);
+void boottrace_dump();
+int boottrace_save(char *fn);
+
+#ifdef BOOTTRACE
+#define boot_mark(s) boottrace_mark(s)
+#define boot_dump() boottrace_dump()
+#define boot_save(fn) boottrace_save(fn)
+#else
+#define boot_mark(s) ((void)0)
+#define boot_dump() ((void)0)
+#define boot_save(fn) ((void)0)
+#endif
@@ -0,0 +1,150 @@
+#include "gpio.h"
+#include "uart.h"
+#include "irq.h"
+
+#define IRQ_BASIC_PENDING ((volatile unsigned int *)(MMIO_BASE + 0x0000B200))
+#define IRQ_PENDING_1 ((volatile unsigned int *)(MMIO_BASE + 0x0000B204))
+#define IRQ_PENDING_2 ((volatile unsigned int *)(MMIO_BASE + 0x0000B208))
+#define FIQ_CONTROL ((volatile unsigned int *)(MMIO_BASE + 0x0000B20C))
+#define ENABLE_IRQS_1 ((volatile unsigned int *)(MMIO_BASE + 0x0000B210))
+#define ENABLE_IRQS_2 ((volatile unsigned int *)(MMIO_BASE + 0x0000B214))
+#define ENABLE_BASIC_IRQS ((volatile unsigned int *)(MMIO_BASE + 0x0000B218))
+#define DISABLE_IRQS_1 ((volatile unsigned int *)(MMIO_BASE + 0x0000B21C))
+#define DISABLE_IRQS_2 ((volatile unsigned int *)(MMIO_BASE + 0x0000B220))
+#define DISABLE_BASIC_IRQS ((volatile unsigned int *)(MMIO_BASE + 0x0000B224))
+
+static irq_fn irq_handlers[IRQ_COUNT];
+static irq_fn fiq_handler_fn;
+// enabled GPU interrupts, so we only look at the pending bits we own
+static volatile unsigned int irq_mask[2];
+
+static char *exc_names[] = {"Synchronous", "IRQ", "FIQ", "SError", "Invalid vector"};
+
+/**
+ * Install a handler for a GPU peripheral interrupt and unmask it.
+ * All GPU interrupts are routed to core 0.
+ */
+void irq_register(unsigned int irq, irq_fn handler)
+{
+    if (irq >= IRQ_COUNT)
+        return;
+    irq_handlers[irq] = handler;
+    irq_mask[irq >> 5] |= 1 << (irq & 31);
+    if (irq < 32)
+        *ENABLE_IRQS_1 = 1 << irq;
+    else
+        *ENABLE_IRQS_2 = 1 << (irq - 32);
+}
+
+/**
+ * Mask a GPU peripheral interrupt and remove its handler
+ */
+void irq_unregister(unsigned int irq)
+{
+    if (irq >= IRQ_COUNT)
+        return;
+    if (irq < 32)
+        *DISABLE_IRQS_1 = 1 << irq;
+    else
+        *DISABLE_IRQS_2 = 1 << (irq - 32);
+    irq_mask[irq >> 5] &= ~(1 << (irq & 31));
+    irq_handlers[irq] = 0;
+}
+
+/**
+ * Install the FIQ handler. Routing a source to FIQ is up to the caller
+ */
+void fiq_register(irq_fn handler)
+{
+    fiq_handler_fn = handler;
+}
+
+/**
+ * Unmask IRQs on this core
+ */
+void irq_enable()
+{
+    asm volatile("msr daifclr, #2");
+}
+
+/**
+ * Mask IRQs on this core
+ */
+void irq_disable()
+{
+    asm volatile("msr daifset, #2");
+}
+
+/**
+ * Mask IRQs and return the previous state for irq_restore()
+ */
+unsigned long irq_save()
+{
+    unsigned long r;
+    asm volatile("mrs %0, daif\n msr daifset, #2" : "=r"(r) : : "memory");
+    return r;
+}
+
+/**
+ * Restore the IRQ mask saved by irq_save()
+ */
+void irq_restore(unsigned long flags)
+{
+    asm volatile("msr daif, %0" : : "r"(flags) : "memory");
+}
+
+/**
+ * Called from the IRQ vector with interrupts masked. Dispatches every
+ * pending interrupt we have a handler for.
+ */
+void irq_handler()
+{
+    unsigned int p, i, n;
+    for (i = 0; i < 2; i++)
+    {
+        p = (i ? *IRQ_PENDING_2 : *IRQ_PENDING_1) & irq_mask[i];
+        while (p)
+        {
+            n = __builtin_ctz(p);
+            p &= p - 1;
+            irq_handlers[(i << 5) + n]();
+        }
+    }
+}
+
+/**
+ * Called from the vectors for everything but IRQs. FIQs are dispatched,
+ * anything else is fatal: dump the registers and halt the core.
+ */
+void exc_handler(unsigned long type, exc_frame_t *frame)
+{
+    if (type == EXC_FIQ && fiq_handler_fn)
+    {
+        fiq_handler_fn();
+        return;
+    }
+    uart_puts("\nEXCEPTION: ");
+    uart_puts(exc_names[type < 5 ? type : 4]);
+    uart_puts("\n  ESR: ");
+    uart_hex(frame->esr >> 32);
+    uart_hex(frame->esr);
+    // exception class
+    uart_puts(" EC ");
+    uart_hex((frame->esr >> 26) & 0x3F);
+    uart_puts("\n  ELR: ");
+    uart_hex(frame->elr >> 32);
+    uart_hex(frame->elr);
+    uart_puts("\n  FAR: ");
+    uart_hex(frame->far >> 32);
+    uart_hex(frame->far);
+    uart_puts("\n  SPSR: ");
+    uart_hex(frame->spsr);
+    uart_puts("\n  LR: ");
+    uart_hex(frame->x[30] >> 32);
+    uart_hex(frame->x[30]);
+    uart_puts("\n");
+    // nobody will take the UART interrupt from here on
+    uart_flush();
+    while (1)
+        asm volatile("wfe");
+}
@@ -0,0 +1,37 @@
+/* GPU peripheral interrupt numbers (IRQ pending 1 and 2 registers) */
+#define IRQ_SYSTIMER1 1
+#define IRQ_SYSTIMER3 3
+#define IRQ_DMA0 16
+#define IRQ_AUX 29
+#define IRQ_GPIO0 49
+#define IRQ_UART 57
+#define IRQ_EMMC 62
+#define IRQ_COUNT 64
+
+/* exception types, see vectors.S */
+#define EXC_SYNC 0
+#define EXC_IRQ 1
+#define EXC_FIQ 2
+#define EXC_SERROR 3
+#define EXC_INVALID 4
+
+typedef void (*irq_fn)(void);
+
+/* saved registers of an exception, see save_all in vectors.S */
+typedef struct
+{
+    unsigned long x[31];
+    unsigned long elr;
+    unsigned long spsr;
+    unsigned long esr;
+    unsigned long far;
+    unsigned long pad;
+} exc_frame_t;
+
+void irq_register(unsigned int irq, irq_fn handler);
+void irq_unregister(unsigned int irq);
+void fiq_register(irq_fn handler);
+void irq_enable();
+void irq_disable();
+unsigned long irq_save();
+void irq_restore(unsigned long flags);
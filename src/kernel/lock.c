@@ -0,0 +1,40 @@
+#include "lock.h"
+#include "mmu.h"
+
+/**
+ * Acquire a spinlock, sleeping with wfe while somebody else holds it
+ */
+void spin_lock(spinlock_t *l)
+{
+    // exclusives need the data cache, without it only one core runs
+    if (!mmu_cached())
+    {
+        *l = 1;
+        return;
+    }
+    while (__atomic_exchange_n(l, 1, __ATOMIC_ACQUIRE))
+    {
+        // don't hammer the exclusive monitor, wait for the owner's sev
+        while (*l)
+            asm volatile("wfe");
+    }
+}
+
+/**
+ * Try to acquire a spinlock once. Returns 1 if we got it, 0 otherwise
+ */
+int spin_trylock(spinlock_t *l)
+{
+    if (!mmu_cached())
+        return !*l && (*l = 1);
+    return !__atomic_exchange_n(l, 1, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Release a spinlock and wake up the waiters
+ */
+void spin_unlock(spinlock_t *l)
+{
+    __atomic_store_n(l, 0, __ATOMIC_RELEASE);
+    asm volatile("dsb sy\n sev");
+}
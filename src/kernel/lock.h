@@ -0,0 +1,5 @@
+typedef volatile unsigned int spinlock_t;
+
+void spin_lock(spinlock_t *l);
+int spin_trylock(spinlock_t *l);
+void spin_unlock(spinlock_t *l);
@@ -0,0 +1,70 @@
+#include "uart.h"
+#include "mmu.h"
+#include "log.h"
+
+/* deferred binary trace, size must be a power of two */
+#define TRACE_SIZE 256
+
+typedef struct
+{
+    unsigned long t;
+    char *s;
+    unsigned int a;
+    unsigned int b;
+} trace_t;
+
+static trace_t trace_ring[TRACE_SIZE];
+static volatile unsigned int trace_head = 0;
+
+/**
+ * Print a message, a value in hexadecimal and a newline
+ */
+void log_hex(char *s, unsigned int v)
+{
+    uart_puts(s);
+    uart_hex(v);
+    uart_puts("\n");
+}
+
+/**
+ * Record a trace entry. Only a few stores, safe from any core or interrupt.
+ * The message must be a constant string, only its pointer is kept.
+ */
+void trace_record(char *s, unsigned int a, unsigned int b)
+{
+    trace_t *e;
+    // exclusives need the data cache, without it only one core runs
+    if (!mmu_cached())
+        e = &trace_ring[trace_head++ % TRACE_SIZE];
+    else
+        e = &trace_ring[__atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED) % TRACE_SIZE];
+    asm volatile("mrs %0, cntpct_el0" : "=r"(e->t));
+    e->s = s;
+    e->a = a;
+    e->b = b;
+}
+
+/**
+ * Print the recorded trace, oldest first, and empty the ring
+ */
+void trace_dump()
+{
+    unsigned int i = trace_head > TRACE_SIZE ? trace_head - TRACE_SIZE : 0;
+    unsigned int end = trace_head;
+    trace_t *e;
+
+    for (; i < end; i++)
+    {
+        e = &trace_ring[i % TRACE_SIZE];
+        uart_hex(e->t >> 32);
+        uart_hex(e->t);
+        uart_puts(" ");
+        uart_puts(e->s);
+        uart_puts(" ");
+        uart_hex(e->a);
+        uart_puts(" ");
+        uart_hex(e->b);
+        uart_puts("\n");
+    }
+    trace_head = 0;
+}
@@ -0,0 +1,41 @@
+#include "uart.h"
+
+/* log levels, pick one at build time with make LOG_LEVEL=n, 0 compiles out everything */
+#define LOG_NONE 0
+#define LOG_ERROR 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
+
+void log_hex(char *s, unsigned int v);
+void trace_record(char *s, unsigned int a, unsigned int b);
+void trace_dump();
+
+#if LOG_LEVEL >= LOG_ERROR
+#define log_error(s) uart_puts(s)
+#define log_errorx(s, v) log_hex(s, v)
+#else
+#define log_error(s) ((void)0)
+#define log_errorx(s, v) ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_INFO
+#define log_info(s) uart_puts(s)
+#define log_infox(s, v) log_hex(s, v)
+#else
+#define log_info(s) ((void)0)
+#define log_infox(s, v) ((void)0)
+#endif
+
+/* debug lines don't touch the UART on the hot path, they go to a binary
+   trace ring (timestamp, message pointer, two values) printed by trace_dump() */
+#if LOG_LEVEL >= LOG_DEBUG
+#define log_trace(s, a, b) trace_record(s, a, b)
+#define log_dump() trace_dump()
+#else
+#define log_trace(s, a, b) ((void)0)
+#define log_dump() ((void)0)
+#endif
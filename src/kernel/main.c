@@ -2,28 +2,669 @@
 #include "uart.h"
 #include "sd.h"
 #include "fat.h"
+#include "smp.h"
+#include "mmu.h"
+#include "irq.h"
+#include "log.h"
+#include "bcache.h"
+#include "bio.h"
+#include "delays.h"
+#include "boottrace.h"
+#include "lfb.h"
+#include "con.h"
+
+// streaming buffer, files are read through it in pieces
+static unsigned char __attribute__((aligned(64))) main_buf[65536];
+
+// blocks per chunk in the overlap benchmark, two of them fit in main_buf
+#define MAIN_CHUNK 64
+
+#ifdef BENCH
+/**
+ * Some work to do with the data, stands in for decompressing or parsing
+ */
+static unsigned int main_sum(unsigned char *buf, unsigned int len)
+{
+    unsigned int i, sum = 0;
+    for (i = 0; i < len; i++)
+        sum = (sum << 1 | sum >> 31) ^ buf[i];
+    return sum;
+}
+
+/**
+ * Read the generic timer, in cntfrq_el0 ticks
+ */
+static unsigned long main_ticks()
+{
+    unsigned long t;
+    asm volatile("isb\n mrs %0, cntpct_el0" : "=r"(t));
+    return t;
+}
+
+/**
+ * Checksum the first 4M of the card twice: reading and summing in turns,
+ * then summing one half of main_buf while the queue fills the other
+ */
+static void main_overlap()
+{
+    bio_t bio[2];
+    unsigned long t;
+    unsigned int i, sum = 0, num = 4 * 1024 * 1024 / 512;
+
+    t = get_system_timer();
+    for (i = 0; i < num; i += MAIN_CHUNK)
+    {
+        sd_readblock(i, main_buf, MAIN_CHUNK);
+        sum ^= main_sum(main_buf, MAIN_CHUNK * 512);
+    }
+    uart_puts("Sequential usec: ");
+    uart_hex(get_system_timer() - t);
+    uart_puts("\n");
+    log_trace("checksum", sum, 0);
+
+    sum = 0;
+    t = get_system_timer();
+    bio[0].lba = 0;
+    bio[0].num = MAIN_CHUNK;
+    bio[0].buffer = main_buf;
+    bio[0].write = 0;
+    bio[0].done = 0;
+    bio[1] = bio[0];
+    bio[1].buffer = main_buf + MAIN_CHUNK * 512;
+    bio_submit(&bio[0]);
+    for (i = 0; i < num; i += MAIN_CHUNK)
+    {
+        bio_wait(&bio[(i / MAIN_CHUNK) & 1]);
+        // keep the card busy with the next chunk while this one is summed
+        if (i + MAIN_CHUNK < num)
+        {
+            bio[(i / MAIN_CHUNK + 1) & 1].lba = i + MAIN_CHUNK;
+            bio_submit(&bio[(i / MAIN_CHUNK + 1) & 1]);
+        }
+        sum ^= main_sum(bio[(i / MAIN_CHUNK) & 1].buffer, MAIN_CHUNK * 512);
+    }
+    uart_puts("Overlapped usec: ");
+    uart_hex(get_system_timer() - t);
+    uart_puts("\n");
+    log_trace("checksum", sum, 0);
+}
+
+/**
+ * Read the first 4M of the card through bcache_read() 4K at a time, then with
+ * sd_readblock() 64K at a time. Build with LOG_LEVEL=0 and LOG_LEVEL=3 to see
+ * what the driver traces cost on the read path
+ */
+static void main_readpass()
+{
+    unsigned long t[2];
+    unsigned int i, num = 4 * 1024 * 1024 / 512;
+
+    bcache_invalidate();
+    t[0] = get_system_timer();
+    for (i = 0; i < num; i += 8)
+        bcache_read(i, main_buf, 8);
+    t[0] = get_system_timer() - t[0];
+    t[1] = get_system_timer();
+    for (i = 0; i < num; i += 128)
+        sd_readblock(i, main_buf, 128);
+    t[1] = get_system_timer() - t[1];
+    uart_puts("LOG_LEVEL ");
+    uart_hex(LOG_LEVEL);
+    uart_puts(", bcache_read usec: ");
+    uart_hex(t[0]);
+    uart_puts(", sd_readblock usec: ");
+    uart_hex(t[1]);
+    uart_puts("\n");
+}
+
+/**
+ * Read the first 2M of the card into a misaligned buffer, which sd_readblock()
+ * serves by PIO, then into an aligned one, which goes by DMA. The idle loop
+ * counts how much of each the CPU had to itself
+ */
+static void main_dma()
+{
+    bio_t b;
+    unsigned long t, idle;
+    unsigned int i, m, num = 2 * 1024 * 1024 / 512;
+
+    for (m = 0; m < 2; m++)
+    {
+        idle = 0;
+        t = get_system_timer();
+        for (i = 0; i < num; i += MAIN_CHUNK)
+        {
+            b.lba = i;
+            b.num = MAIN_CHUNK;
+            b.buffer = m ? main_buf : main_buf + 4;
+            b.write = 0;
+            b.done = 0;
+            bio_submit(&b);
+            while (bio_poll(&b) == BIO_PENDING)
+                idle++;
+        }
+        t = get_system_timer() - t;
+        uart_puts(m ? "DMA usec: " : "PIO usec: ");
+        uart_hex(t);
+        uart_puts(", KB/s: ");
+        uart_hex(t ? num / 2 * 1000000UL / t : 0);
+        uart_puts(", idle loops: ");
+        uart_hex(idle);
+        uart_puts("\n");
+    }
+}
+
+/**
+ * Read the first 4M of the card at default speed, then at high speed if CMD6
+ * gets the card there, printing the bus clock each pass actually ran at
+ */
+static void main_busspeed()
+{
+    unsigned long t;
+    unsigned int i, hz, high, num = 4 * 1024 * 1024 / 512;
+
+    for (high = 0; high < 2; high++)
+    {
+        if (!(hz = sd_busspeed(high)))
+        {
+            uart_puts("Bus speed switch failed\n");
+            continue;
+        }
+        t = get_system_timer();
+        for (i = 0; i < num; i += 128)
+            sd_readblock(i, main_buf, 128);
+        t = get_system_timer() - t;
+        uart_puts("Bus Hz: ");
+        uart_hex(hz);
+        uart_puts(", usec: ");
+        uart_hex(t);
+        uart_puts(", KB/s: ");
+        uart_hex(t ? num / 2 * 1000000UL / t : 0);
+        uart_puts("\n");
+    }
+}
+
+/**
+ * Write a 4M scratch file with fat_write() 64K at a time, close it so the
+ * directory entry and FAT are on the card too, then delete it
+ */
+static void main_write()
+{
+    fat_file_t file;
+    unsigned long t;
+    unsigned int i, n = 0, len = 4 * 1024 * 1024;
+    int fd;
+
+    // left over if the last boot was cut short
+    if (fat_lookup("/BENCH.DAT", &file))
+        fat_delete("/BENCH.DAT");
+    t = get_system_timer();
+    if ((fd = fat_create("/BENCH.DAT")) < 0)
+    {
+        uart_puts("Unable to create /BENCH.DAT\n");
+        return;
+    }
+    for (i = 0; i < len; i += sizeof(main_buf))
+        n += fat_write(fd, main_buf, sizeof(main_buf));
+    fat_close(fd);
+    t = get_system_timer() - t;
+    fat_delete("/BENCH.DAT");
+    fat_sync();
+    uart_puts("File write usec: ");
+    uart_hex(t);
+    uart_puts(", bytes: ");
+    uart_hex(n);
+    uart_puts(", KB/s: ");
+    uart_hex(t ? n / 1024 * 1000000UL / t : 0);
+    uart_puts("\n");
+}
+
+/**
+ * One scheduler benchmark job, checksums main_buf into *arg
+ */
+static void main_job(void *arg)
+{
+    *(unsigned int *)arg = main_sum(main_buf, sizeof(main_buf));
+}
+
+/**
+ * Run the same 64 jobs on 1 to 4 cores, the time should go down with each
+ */
+static void main_smp()
+{
+    static unsigned int sums[64];
+    unsigned long t;
+    unsigned int i, n;
+
+    for (n = 1; n <= smp_ncpus(); n++)
+    {
+        smp_setcores(n);
+        t = get_system_timer();
+        for (i = 0; i < 64; i++)
+            smp_submit(main_job, &sums[i]);
+        smp_wait();
+        uart_puts("SMP cores: ");
+        uart_hex(n);
+        uart_puts(", usec: ");
+        uart_hex(get_system_timer() - t);
+        uart_puts("\n");
+    }
+    smp_setcores(SMP_NCPU);
+}
+
+// ticks taken and cycles spent in the handler body during the IRQ benchmark
+static volatile unsigned int main_nirq;
+static volatile unsigned long main_irqbody;
+
+/**
+ * Read the PMU cycle counter, in CPU clocks unlike cntpct_el0
+ */
+static unsigned long main_cycles()
+{
+    unsigned long c;
+    asm volatile("isb\n mrs %0, pmccntr_el0" : "=r"(c));
+    return c;
+}
+
+/**
+ * IRQ benchmark tick, acknowledges and re-arms the system timer
+ */
+static void main_tick()
+{
+    unsigned long c = main_cycles();
+    systimer_ack();
+    systimer_arm(50);
+    main_nirq++;
+    main_irqbody += main_cycles() - c;
+}
+
+/**
+ * Sum main_buf with interrupts masked, then with a system timer tick every 50 usec.
+ * The extra cycles per tick less the handler body are what the vector costs,
+ * from entry through irq_handler's dispatch to eret
+ */
+static void main_irq()
+{
+    unsigned long flags, c, quiet, busy, body;
+    unsigned int i, n, sum = 0;
+
+    // start the cycle counter from zero
+    asm volatile("msr pmcr_el0, %0\n msr pmcntenset_el0, %1" : : "r"(1UL | 1UL << 2), "r"(1UL << 31));
+    flags = irq_save();
+    c = main_cycles();
+    for (i = 0; i < 64; i++)
+        sum ^= main_sum(main_buf, sizeof(main_buf));
+    quiet = main_cycles() - c;
+    irq_restore(flags);
+
+    main_nirq = 0;
+    main_irqbody = 0;
+    irq_register(IRQ_SYSTIMER1, main_tick);
+    systimer_arm(50);
+    c = main_cycles();
+    for (i = 0; i < 64; i++)
+        sum ^= main_sum(main_buf, sizeof(main_buf));
+    busy = main_cycles() - c;
+    flags = irq_save();
+    irq_unregister(IRQ_SYSTIMER1);
+    systimer_ack();
+    irq_restore(flags);
+    n = main_nirq;
+    body = main_irqbody;
+    log_trace("checksum", sum, 0);
+    if (!n)
+    {
+        uart_puts("IRQ benchmark: no system timer ticks\n");
+        return;
+    }
+    c = busy > quiet ? (busy - quiet) / n : 0;
+    uart_puts("IRQ ticks: ");
+    uart_hex(n);
+    uart_puts(", cycles per IRQ: ");
+    uart_hex(c);
+    uart_puts(", handler body: ");
+    uart_hex(body / n);
+    uart_puts(", entry to eret: ");
+    uart_hex(c > body / n ? c - body / n : 0);
+    uart_puts("\n");
+}
+
+/**
+ * Fill the first len bytes of main_buf with log lines, returns len
+ */
+static unsigned int main_logfill(unsigned int len)
+{
+    char *line = "[ 00000000 ] EMMC: read lba 0001F400, 128 blocks\n";
+    unsigned int i, j;
+
+    for (i = j = 0; i < len; i++, j++)
+    {
+        if (!line[j])
+            j = 0;
+        main_buf[i] = line[j];
+    }
+    return len;
+}
+
+/**
+ * Send an 8K log twice: waiting in uart_flush() after each piece, then queueing
+ * it with uart_write() between work units. Both take as long as the UART does,
+ * the second one gets work done until the last piece is queued
+ */
+static void main_log()
+{
+    unsigned long f, t[2];
+    unsigned int len = main_logfill(8192), off, work = 0, sum = 0;
+
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(f));
+    t[0] = main_ticks();
+    for (off = 0; off < len;)
+    {
+        off += uart_write(main_buf + off, len - off);
+        uart_flush();
+    }
+    t[0] = main_ticks() - t[0];
+    t[1] = main_ticks();
+    for (off = 0; off < len; work++)
+    {
+        off += uart_write(main_buf + off, len - off);
+        sum ^= main_sum(main_buf + len, 1024);
+    }
+    uart_flush();
+    t[1] = main_ticks() - t[1];
+    log_trace("checksum", sum, 0);
+    uart_puts("\nLog flushed usec: ");
+    uart_hex(t[0] * 1000000 / f);
+    uart_puts(", queued usec: ");
+    uart_hex(t[1] * 1000000 / f);
+    uart_puts(", work units meanwhile: ");
+    uart_hex(work);
+    uart_puts("\n");
+}
+
+/**
+ * Console throughput through uart_write() and uart_flush(), about BAUD / 10 bytes
+ * per second on the board. Timed with cntpct_el0, which QEMU runs like the board
+ * while its serial chardev drains the FIFO as fast as the host takes it
+ */
+static void main_uartrate()
+{
+    unsigned long f, t;
+    unsigned int len = main_logfill(32768), off;
+
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(f));
+    t = main_ticks();
+    for (off = 0; off < len;)
+        off += uart_write(main_buf + off, len - off);
+    uart_flush();
+    t = main_ticks() - t;
+    uart_puts("\nUART bytes per second: ");
+    uart_hex(t ? len * f / t : 0);
+    uart_puts("\n");
+}
+#endif
+
+#ifdef BENCH
+/**
+ * Redraw the whole screen for a second, fill and flip each frame
+ */
+static void main_redraw()
+{
+    unsigned long t, draw = 0, d;
+    unsigned int frames;
+
+    t = get_system_timer();
+    for (frames = 0; get_system_timer() - t < 1000000; frames++)
+    {
+        lfb_begin();
+        d = get_system_timer();
+        lfb_fill(frames & 1 ? 0x204060 : 0x402010);
+        draw += get_system_timer() - d;
+        lfb_end();
+    }
+    uart_puts("Frames per second: ");
+    uart_hex(frames);
+    uart_puts("\nDrawing usec per frame: ");
+    uart_hex(frames ? draw / frames : 0);
+    uart_puts("\n");
+}
+#endif
+
+#ifdef BENCH
+/**
+ * Glyphs per second through lfb_proprint, rasterising every line from
+ * scratch and then from the glyph cache
+ */
+static void main_text()
+{
+    char *line = "The quick brown fox jumps over the lazy dog. 0123456789 ()[]{}<>+-*/=!?";
+    unsigned long t, cold, warm;
+    unsigned int i, n;
+
+    for (n = 0; line[n]; n++)
+        ;
+    t = get_system_timer();
+    for (i = 0; i < 32; i++)
+    {
+        lfb_glyphflush();
+        lfb_proprint(0, i * 16, line);
+    }
+    cold = get_system_timer() - t;
+    t = get_system_timer();
+    for (i = 0; i < 32; i++)
+        lfb_proprint(0, i * 16, line);
+    warm = get_system_timer() - t;
+    uart_puts("Glyphs per second cold: ");
+    uart_hex(cold ? 32 * n * 1000000UL / cold : 0);
+    uart_puts("\nGlyphs per second warm: ");
+    uart_hex(warm ? 32 * n * 1000000UL / warm : 0);
+    uart_puts("\n");
+}
+#endif
+
+#ifdef BENCH
+/**
+ * SSFN code point lookups per second in the Latin, Cyrillic and CJK ranges
+ */
+static void main_lookup()
+{
+    static unsigned int ranges[] = {0x20, 0x7F, 0x400, 0x460, 0x4E00, 0x9FFF};
+    static char *names[] = {"Latin", "Cyrillic", "CJK"};
+    unsigned long t;
+    unsigned int i, c, n, found;
+
+    for (i = 0; i < 3; i++)
+    {
+        t = get_system_timer();
+        for (n = found = 0; n < 100000; n++)
+        {
+            c = ranges[i * 2] + n % (ranges[i * 2 + 1] - ranges[i * 2]);
+            found += lfb_findglyph(c) != 0;
+        }
+        t = get_system_timer() - t;
+        uart_puts(names[i]);
+        uart_puts(" lookups per second: ");
+        uart_hex(t ? n * 1000000UL / t : 0);
+        uart_puts(", found ");
+        uart_hex(found);
+        uart_puts("\n");
+    }
+}
+#endif
+
+#ifdef BENCH
+/**
+ * PSF characters per second, one pixel at a time and 8 pixels per vector op
+ */
+static void main_psf()
+{
+    char *line = "The quick brown fox jumps over the lazy dog. 0123456789 ()[]{}<>+-*/=!?";
+    unsigned long t;
+    unsigned int i, n, v;
+
+    for (n = 0; line[n]; n++)
+        ;
+    for (v = 0; v < 2; v++)
+    {
+        lfb_simd(v);
+        t = get_system_timer();
+        for (i = 0; i < 48; i++)
+            lfb_print(0, i * 16, line);
+        t = get_system_timer() - t;
+        uart_puts(v ? "PSF chars per second NEON: " : "PSF chars per second scalar: ");
+        uart_hex(t ? 48 * n * 1000000UL / t : 0);
+        uart_puts("\n");
+    }
+}
+#endif
+
+#ifdef BENCH
+/**
+ * Load a file with fat_readfile() and draw a screen of PSF text, with the
+ * caches off and then on, to see what the identity map and caches are worth
+ */
+static void main_caches(int part)
+{
+    char *line = "The quick brown fox jumps over the lazy dog. 0123456789 ()[]{}<>+-*/=!?";
+    unsigned long f, flags, t[2][3];
+    unsigned int cluster = 0, i, c;
+
+    if (part && !(cluster = fat_getcluster("/LICENCE.broadcom")))
+        cluster = fat_getcluster("/kernel8.img");
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(f));
+    // with the caches off nothing may take a lock on another core, nor an interrupt here
+    smp_setcores(1);
+    flags = irq_save();
+    for (c = 0; c < 2; c++)
+    {
+        mmu_caches(c);
+        bcache_invalidate();
+        t[c][0] = main_ticks();
+        if (cluster)
+            fat_readfile(cluster);
+        t[c][1] = main_ticks();
+        for (i = 0; i < 48; i++)
+            lfb_print(0, i * 16, line);
+        t[c][2] = main_ticks();
+    }
+    irq_restore(flags);
+    smp_setcores(SMP_NCPU);
+    for (c = 0; c < 2; c++)
+    {
+        uart_puts(c ? "Caches on, fat_readfile usec: " : "Caches off, fat_readfile usec: ");
+        uart_hex((t[c][1] - t[c][0]) * 1000000 / f);
+        uart_puts(", text usec: ");
+        uart_hex((t[c][2] - t[c][1]) * 1000000 / f);
+        uart_puts("\n");
+    }
+}
+
+/**
+ * Console lines per second with log-like output, showing each line as it comes
+ * and showing them in batches of 16
+ */
+static void main_console()
+{
+    char *line = "[ 00000000 ] EMMC: read lba 0001F400, 128 blocks\n";
+    unsigned long t;
+    unsigned int i, n, f, rate[2];
+
+    for (n = 0; line[n]; n++)
+        ;
+    for (f = 0; f < 2; f++)
+    {
+        t = get_system_timer();
+        for (i = 0; i < 2000; i++)
+        {
+            con_write(line, n);
+            if (!f || i % 16 == 15)
+                con_flush();
+        }
+        t = get_system_timer() - t;
+        rate[f] = t ? 2000 * 1000000UL / t : 0;
+    }
+    uart_puts("Console lines per second, each: ");
+    uart_hex(rate[0]);
+    uart_puts(", batched: ");
+    uart_hex(rate[1]);
+    uart_puts("\n");
+}
+#endif
 
 void main()
 {
-    unsigned int cluster;
+    unsigned int n, total, hits, misses, ra;
+    int fd, part = 0;
+    char c;
+    boot_mark("main");
     // set up serial console
     uart_init();
+    boot_mark("uart_init");
+
+    // identity map the memory and turn on the caches
+    mmu_init();
+    boot_mark("mmu_init");
+
+    // wake up the other cores and start the scheduler
+    smp_init();
+    boot_mark("smp_init");
+#ifdef BENCH
+    main_smp();
+    boot_mark("SMP benchmark");
+#endif
+
+    // take interrupts on this core from now on
+    irq_enable();
+#ifdef BENCH
+    main_irq();
+    boot_mark("IRQ benchmark");
+    main_log();
+    boot_mark("log benchmark");
+    main_uartrate();
+    boot_mark("UART benchmark");
+#endif
 
     // initialize EMMC and detect SD card type
     if (sd_init() == SD_OK)
     {
+        boot_mark("sd_init");
         // read the master boot record and find our partition
-        if (fat_getpartition())
+        if ((part = fat_getpartition()))
         {
-            // find out file in root directory entries
-            cluster = fat_getcluster("LICENC~1BRO");
-            if (cluster == 0)
-                cluster = fat_getcluster("KERNEL8 IMG");
-            if (cluster)
+            // boot to first sector, sd_init() printed its phases already
+            log_infox("Partition found at usec: ", get_system_timer());
+            boot_mark("fat_getpartition");
+            // find our file, long names and subdirectories work too
+            fd = fat_open("/LICENCE.broadcom");
+            if (fd < 0)
+                fd = fat_open("/kernel8.img");
+            boot_mark("fat_open");
+            if (fd >= 0)
             {
-                // read into memory
-                uart_dump(fat_readfile(cluster));
+                // stream it through a fixed buffer, dump the beginning
+                total = n = fat_read(fd, main_buf, sizeof(main_buf));
+                uart_dump(main_buf);
+                while ((n = fat_read(fd, main_buf, sizeof(main_buf))))
+                    total += n;
+                log_infox("Bytes read: ", total);
+                fat_close(fd);
+                boot_mark("file read");
             }
+            bcache_stats(&hits, &misses, &ra);
+            log_trace("bcache hits, misses", hits, misses);
+            log_trace("bcache read-ahead blocks", ra, 0);
+#ifdef BENCH
+            main_overlap();
+            boot_mark("overlap benchmark");
+            main_readpass();
+            boot_mark("read benchmark");
+            main_dma();
+            boot_mark("DMA benchmark");
+            main_busspeed();
+            boot_mark("bus speed benchmark");
+            main_write();
+            boot_mark("write benchmark");
+#endif
         }
         else
         {
@@ -31,9 +672,43 @@ void main()
         }
     }
 
-    // echo everything back
+    // set up the screen, benchmark it with make BENCH=1
+    lfb_init();
+    boot_mark("lfb_init");
+#ifdef BENCH
+    main_redraw();
+    boot_mark("redraw benchmark");
+    main_text();
+    boot_mark("text benchmark");
+    main_lookup();
+    boot_mark("lookup benchmark");
+    main_psf();
+    boot_mark("PSF benchmark");
+    main_caches(part);
+    boot_mark("cache benchmark");
+#endif
+    // the screen is the console from now on
+    con_init();
+    uart_mirror(con_write);
+#ifdef BENCH
+    main_console();
+    boot_mark("console benchmark");
+#endif
+
+    // print what the drivers traced while we were busy
+    log_dump();
+
+    // how long it took to get here, kept on the card too with make BOOTTRACE=1
+    boot_mark("main loop");
+    boot_dump();
+    if (part)
+        boot_save("/BOOTTRC.TXT");
+
+    // echo everything back, the screen catches up with the console in between
     while (1)
     {
-        uart_send(uart_getc());
+        if (uart_read(&c, 1))
+            uart_send(c == '\r' ? '\n' : c);
+        con_flush();
     }
 }
\ No newline at end of file
@@ -0,0 +1,226 @@
+#include "gpio.h"
+#include "mbox.h"
+#include "uart.h"
+#include "mmu.h"
+
+#define PAGESIZE 4096
+#define BLOCKSIZE 0x200000
+
+// granularity
+#define PT_PAGE 0b11 // 4k granule
+#define PT_BLOCK 0b01 // 2M granule
+// accessibility
+#define PT_KERNEL (0 << 6) // privileged, supervisor EL1 access only
+#define PT_RW (0 << 7)     // read-write
+// shareability
+#define PT_OSH (2 << 8) // outter shareable
+#define PT_ISH (3 << 8) // inner shareable
+#define PT_AF (1 << 10) // accessed flag
+// defined in MAIR register
+#define PT_DEV (0 << 2) // device MMIO
+#define PT_MEM (1 << 2) // normal memory, write-back cacheable
+#define PT_NC (2 << 2)  // normal memory, non-cacheable (GPU memory, framebuffer)
+#define PT_XN (3UL << 53) // UXN | PXN, never execute
+
+#define MAIR_VALUE ((0x04 << (0 * 8)) | (0xFF << (1 * 8)) | (0x44 << (2 * 8)))
+
+// 39 bits of address space, table walk starts at level 1, 4k granule,
+// inner shareable, inner and outer write-back write-allocate walks
+// no TTBR1 walks (EPD1), 32 bits physical address
+#define TCR_T0SZ (64 - 39)
+#define TCR_VALUE ((1 << 23) | (3 << 12) | (1 << 10) | (1 << 8) | TCR_T0SZ)
+
+#define SCTLR_MMU (1 << 0)
+#define SCTLR_ALIGN (1 << 1)
+#define SCTLR_DCACHE (1 << 2)
+#define SCTLR_ICACHE (1 << 12)
+
+/* level 1 table: 1G blocks, entry 0 points to the level 2 table of 2M blocks */
+static unsigned long __attribute__((aligned(PAGESIZE))) mmu_l1[512];
+static unsigned long __attribute__((aligned(PAGESIZE))) mmu_l2[512];
+
+/**
+ * Ask the firmware where the ARM's part of the RAM ends, the rest is the GPU's
+ */
+static unsigned long mmu_armmem()
+{
+    mbox[0] = 8 * 4;
+    mbox[1] = MBOX_REQUEST;
+    mbox[2] = 0x10005; // get ARM memory
+    mbox[3] = 8;
+    mbox[4] = 0;
+    mbox[5] = 0; // base address
+    mbox[6] = 0; // size
+    mbox[7] = MBOX_TAG_LAST;
+    if (mbox_call(MBOX_CH_PROP) && mbox[6])
+        return mbox[5] + mbox[6];
+    // the default 64M GPU split
+    return MMIO_BASE - 0x3000000;
+}
+
+/**
+ * Build the identity map: ARM RAM write-back cacheable, GPU RAM (framebuffer)
+ * non-cacheable, MMIO windows Device-nGnRE. Then turn on the MMU on this core.
+ */
+void mmu_init()
+{
+    unsigned long r, a, armmem = mmu_armmem();
+
+    // level 1: first gigabyte through the level 2 table
+    mmu_l1[0] = (unsigned long)&mmu_l2 | PT_PAGE;
+    // level 1: second gigabyte as one block, ARM local peripherals (0x40000000)
+    mmu_l1[1] = 0x40000000 | PT_BLOCK | PT_AF | PT_KERNEL | PT_OSH | PT_DEV | PT_XN;
+    for (r = 2; r < 512; r++)
+        mmu_l1[r] = 0;
+
+    // level 2: 2M blocks
+    for (r = 0; r < 512; r++)
+    {
+        a = r * BLOCKSIZE;
+        if (a >= MMIO_BASE)
+            mmu_l2[r] = a | PT_BLOCK | PT_AF | PT_KERNEL | PT_OSH | PT_DEV | PT_XN;
+        else if (a >= armmem)
+            mmu_l2[r] = a | PT_BLOCK | PT_AF | PT_KERNEL | PT_OSH | PT_NC | PT_XN;
+        else
+            mmu_l2[r] = a | PT_BLOCK | PT_AF | PT_KERNEL | PT_ISH | PT_MEM;
+    }
+
+    mmu_enable();
+    uart_puts("MMU: enabled, ARM memory ends at ");
+    uart_hex(armmem);
+    uart_puts("\n");
+}
+
+/**
+ * Load the identity map on the calling core and enable the MMU and caches.
+ * Secondary cores call this on their own after mmu_init() built the tables.
+ */
+void mmu_enable()
+{
+    unsigned long r;
+
+    asm volatile("msr mair_el1, %0" : : "r"((unsigned long)MAIR_VALUE));
+    asm volatile("msr tcr_el1, %0" : : "r"((unsigned long)TCR_VALUE));
+    asm volatile("msr ttbr0_el1, %0" : : "r"((unsigned long)&mmu_l1));
+    asm volatile("isb\n tlbi vmalle1\n dsb ish\n isb");
+    asm volatile("mrs %0, sctlr_el1" : "=r"(r));
+    r |= SCTLR_MMU | SCTLR_DCACHE | SCTLR_ICACHE;
+    r &= ~SCTLR_ALIGN;
+    asm volatile("msr sctlr_el1, %0\n isb" : : "r"(r));
+}
+
+/**
+ * Return the smallest data cache line size
+ */
+static unsigned long dcache_line()
+{
+    unsigned long r;
+    asm volatile("mrs %0, ctr_el0" : "=r"(r));
+    return 4 << ((r >> 16) & 0xF);
+}
+
+/**
+ * Write back a range to memory before a device (DMA, VideoCore) reads it
+ */
+void dcache_clean(void *start, unsigned long len)
+{
+    unsigned long l = dcache_line(), a = (unsigned long)start & ~(l - 1);
+    for (; a < (unsigned long)start + len; a += l)
+        asm volatile("dc cvac, %0" : : "r"(a) : "memory");
+    asm volatile("dsb sy");
+}
+
+/**
+ * Discard cached copies of a range after a device wrote it. Partial lines at
+ * the ends are cleaned too, so neighbouring data isn't lost.
+ */
+void dcache_invalidate(void *start, unsigned long len)
+{
+    unsigned long l = dcache_line(), a = (unsigned long)start & ~(l - 1);
+    unsigned long e = (unsigned long)start + len;
+    for (; a < e; a += l)
+    {
+        if (a < (unsigned long)start || a + l > e)
+            asm volatile("dc civac, %0" : : "r"(a) : "memory");
+        else
+            asm volatile("dc ivac, %0" : : "r"(a) : "memory");
+    }
+    asm volatile("dsb sy");
+}
+
+/**
+ * Write back and discard a range
+ */
+void dcache_flush(void *start, unsigned long len)
+{
+    unsigned long l = dcache_line(), a = (unsigned long)start & ~(l - 1);
+    for (; a < (unsigned long)start + len; a += l)
+        asm volatile("dc civac, %0" : : "r"(a) : "memory");
+    asm volatile("dsb sy");
+}
+
+/**
+ * Returns 1 if the data cache is on for this core. Exclusives don't work
+ * without it, see spin_lock()
+ */
+int mmu_cached()
+{
+    unsigned long r;
+    asm volatile("mrs %0, sctlr_el1" : "=r"(r));
+    return (r & SCTLR_DCACHE) != 0;
+}
+
+/**
+ * Turn the data and instruction caches of this core off or back on, the
+ * identity map stays. Only to see what they are worth: while they are off
+ * interrupts must be masked and no other core may take a lock.
+ */
+void mmu_caches(int on)
+{
+    unsigned long r;
+
+    asm volatile("mrs %0, sctlr_el1" : "=r"(r));
+    if (on)
+    {
+        // nothing got allocated while they were off, the caches are clean
+        asm volatile("ic iallu\n dsb sy\n isb");
+        asm volatile("msr sctlr_el1, %0\n isb" : : "r"(r | SCTLR_DCACHE | SCTLR_ICACHE));
+        return;
+    }
+    // clean and invalidate every data cache level by set/way right after
+    // turning it off, all in registers: a dirty line written back later
+    // would overwrite what went to memory directly in between
+    asm volatile("msr sctlr_el1, %0\n isb\n"
+                 "mrs x9, clidr_el1\n"
+                 "mov x10, #0\n"                 // level << 1
+                 "1: add x11, x10, x10, lsr #1\n" // level * 3, cache type in clidr
+                 "lsr x12, x9, x11\n"
+                 "and x12, x12, #7\n"
+                 "cbz x12, 5f\n"                 // no more levels
+                 "cmp x12, #2\n"
+                 "b.lt 4f\n"                     // instruction cache only
+                 "msr csselr_el1, x10\n isb\n"
+                 "mrs x12, ccsidr_el1\n"
+                 "and x13, x12, #7\n"
+                 "add x13, x13, #4\n"            // set shift, log2 of the line size
+                 "ubfx x14, x12, #3, #10\n"      // ways - 1
+                 "clz w15, w14\n"                // way shift
+                 "ubfx x16, x12, #13, #15\n"     // sets - 1
+                 "2: mov x17, x16\n"
+                 "3: lslv x12, x14, x15\n"
+                 "lslv x11, x17, x13\n"
+                 "orr x12, x12, x11\n"
+                 "orr x12, x12, x10\n"
+                 "dc cisw, x12\n"
+                 "subs x17, x17, #1\n"
+                 "b.ge 3b\n"
+                 "subs x14, x14, #1\n"
+                 "b.ge 2b\n"
+                 "4: add x10, x10, #2\n"
+                 "cmp x10, #14\n"
+                 "b.lt 1b\n"
+                 "5: dsb sy\n ic iallu\n dsb sy\n isb"
+                 :
+                 : "r"(r & ~(SCTLR_DCACHE | SCTLR_ICACHE))
+                 : "x9", "x10", "x11", "x12", "x13", "x14", "x15", "x16", "x17", "cc", "memory");
+}
@@ -0,0 +1,7 @@
+void mmu_init();
+void mmu_enable();
+int mmu_cached();
+void mmu_caches(int on);
+void dcache_clean(void *start, unsigned long len);
+void dcache_invalidate(void *start, unsigned long len);
+void dcache_flush(void *start, unsigned long len);
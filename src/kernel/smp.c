@@ -0,0 +1,198 @@
+#include "uart.h"
+#include "lock.h"
+#include "smp.h"
+#include "mmu.h"
+
+/* the firmware's armstub parks secondary cores polling these (0xd8 is core 0's slot) */
+#define SPIN_TABLE ((volatile unsigned long *)0xd8)
+
+extern void _secondary_start();
+
+typedef struct
+{
+    smp_task_fn fn;
+    void *arg;
+} smp_task_t;
+
+/* per-core data, one cache line aligned block each so cores don't false share */
+typedef struct
+{
+    unsigned int id;
+    volatile unsigned int online;
+    unsigned long executed;
+    unsigned long stolen;
+    spinlock_t lock;
+    // owner pushes and pops at bottom, thieves take from top
+    unsigned int top;
+    unsigned int bottom;
+    smp_task_t queue[SMP_QUEUE_SIZE];
+} __attribute__((aligned(64))) cpu_t;
+
+static cpu_t cpus[SMP_NCPU];
+// number of submitted but not yet finished tasks
+static volatile unsigned int smp_pending = 0;
+// cores with a higher ID leave the queues alone, see smp_setcores()
+static volatile unsigned int smp_cores = SMP_NCPU;
+
+/**
+ * Return the ID of the core we are running on
+ */
+unsigned int smp_coreid()
+{
+    unsigned long r;
+    asm volatile("mrs %0, mpidr_el1" : "=r"(r));
+    return r & 3;
+}
+
+/**
+ * Return the number of cores taking part in scheduling
+ */
+unsigned int smp_ncpus()
+{
+    unsigned int i, n = 0;
+    for (i = 0; i < SMP_NCPU; i++)
+        if (cpus[i].online)
+            n++;
+    return n;
+}
+
+/**
+ * Take a task from the bottom of our own queue (LIFO, cache hot)
+ */
+static int smp_pop(cpu_t *cpu, smp_task_t *task)
+{
+    int r = 0;
+    spin_lock(&cpu->lock);
+    if (cpu->bottom != cpu->top)
+    {
+        cpu->bottom--;
+        *task = cpu->queue[cpu->bottom % SMP_QUEUE_SIZE];
+        r = 1;
+    }
+    spin_unlock(&cpu->lock);
+    return r;
+}
+
+/**
+ * Steal the oldest task from the top of another core's queue (FIFO)
+ */
+static int smp_steal(cpu_t *victim, smp_task_t *task)
+{
+    int r = 0;
+    // don't wait on a busy victim, just try the next one
+    if (victim->top == victim->bottom || !spin_trylock(&victim->lock))
+        return 0;
+    if (victim->bottom != victim->top)
+    {
+        *task = victim->queue[victim->top % SMP_QUEUE_SIZE];
+        victim->top++;
+        r = 1;
+    }
+    spin_unlock(&victim->lock);
+    return r;
+}
+
+/**
+ * Submit a job to the calling core's queue. Idle cores will steal it.
+ * Returns 0 if the queue is full.
+ */
+int smp_submit(smp_task_fn fn, void *arg)
+{
+    cpu_t *cpu = &cpus[smp_coreid()];
+    int r = 0;
+    spin_lock(&cpu->lock);
+    if (cpu->bottom - cpu->top < SMP_QUEUE_SIZE)
+    {
+        cpu->queue[cpu->bottom % SMP_QUEUE_SIZE].fn = fn;
+        cpu->queue[cpu->bottom % SMP_QUEUE_SIZE].arg = arg;
+        cpu->bottom++;
+        __atomic_add_fetch(&smp_pending, 1, __ATOMIC_RELAXED);
+        r = 1;
+    }
+    spin_unlock(&cpu->lock);
+    return r;
+}
+
+/**
+ * Run one task, either from our queue or stolen from someone else's.
+ * Returns 0 if there was nothing to do.
+ */
+int smp_runone()
+{
+    unsigned int i, id = smp_coreid();
+    cpu_t *cpu = &cpus[id];
+    smp_task_t task;
+
+    if (!smp_pop(cpu, &task))
+    {
+        for (i = 1; i < SMP_NCPU; i++)
+            if (smp_steal(&cpus[(id + i) % SMP_NCPU], &task))
+                break;
+        if (i == SMP_NCPU)
+            return 0;
+        cpu->stolen++;
+    }
+    task.fn(task.arg);
+    cpu->executed++;
+    __atomic_sub_fetch(&smp_pending, 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * Help out with the queued jobs until every submitted task has finished
+ */
+void smp_wait()
+{
+    while (__atomic_load_n(&smp_pending, __ATOMIC_ACQUIRE))
+    {
+        if (!smp_runone())
+            asm volatile("yield");
+    }
+}
+
+/**
+ * Only let the first n cores run jobs, to see how the work scales with them.
+ * Core 0 always takes part
+ */
+void smp_setcores(unsigned int n)
+{
+    smp_cores = n;
+    asm volatile("dsb sy\n sev");
+}
+
+/**
+ * Secondary cores' C entry point, called from start.S on their own stack
+ */
+void smp_secondary(unsigned int core)
+{
+    cpus[core].online = 1;
+    while (1)
+    {
+        // sleep until somebody submits work (spin_unlock does sev)
+        if (core >= smp_cores || !smp_runone())
+            asm volatile("wfe");
+    }
+}
+
+/**
+ * Release the parked secondary cores through the spin table mailboxes
+ */
+void smp_init()
+{
+    unsigned int i;
+
+    for (i = 0; i < SMP_NCPU; i++)
+        cpus[i].id = i;
+    cpus[0].online = 1;
+    for (i = 1; i < SMP_NCPU; i++)
+        SPIN_TABLE[i] = (unsigned long)&_secondary_start;
+    // parked cores poll the spin table with their caches off
+    dcache_clean((void *)&SPIN_TABLE[1], (SMP_NCPU - 1) * sizeof(unsigned long));
+    asm volatile("dsb sy\n sev");
+    // give them a chance to come up, but don't hang if one doesn't
+    for (i = 0; i < 1000000 && smp_ncpus() < SMP_NCPU; i++)
+        asm volatile("nop");
+    uart_puts("SMP: cores online: ");
+    uart_hex(smp_ncpus());
+    uart_puts("\n");
+}
@@ -0,0 +1,13 @@
+#define SMP_NCPU 4
+#define SMP_QUEUE_SIZE 256
+
+typedef void (*smp_task_fn)(void *arg);
+
+unsigned int smp_coreid();
+unsigned int smp_ncpus();
+void smp_init();
+int smp_submit(smp_task_fn fn, void *arg);
+int smp_runone();
+void smp_wait();
+void smp_setcores(unsigned int n);
+void smp_secondary(unsigned int core);